@@ -1,17 +1,26 @@
-/*ki--	bare-bones, vi-like, in 800 lines.	*/
+/*ki--	bare-bones, vi-like, in under 3500 lines.	*/
 /*LICENSE: use it however you want.		*/
+#define _GNU_SOURCE /* memmem() */
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
@@ -19,6 +28,7 @@
 // Printable or not
 #define PRINTABLE 0
 #define NONPRINTABLE 1
+#define DIFFCHANGED 2 /* Row differs from the file on disk, see :diff. */
 // Modes
 #define INSERT 2
 #define COMMAND 1
@@ -29,9 +39,13 @@ typedef struct erow {
   unsigned int idx;   /* Row index in the file, zero-based. */
   unsigned int size;  /* Size of the row, excluding the null term. */
   unsigned int rsize; /* Size of the rendered row. */
-  char *chars;        /* Row content. */
-  char *render;       /* Row content "rendered" for screen (for TABs). */
-  unsigned char *hl;  /* Syntax highlight type for each character in render.*/
+  uint64_t hash;      /* Hash of the row content. */
+  unsigned char mark; /* DIFFCHANGED if marked by :diff, else PRINTABLE. */
+  char *chars;        /* Row content, from rowAlloc(). */
+  char *render;       /* Row content "rendered" for screen (for TABs), built
+                         when the row is drawn, NULL if not cached. */
+  unsigned char *hl;  /* Syntax highlight type for each character in render,
+                         plus one for the row itself. */
 } erow;
 
 struct editorConfig {
@@ -43,8 +57,15 @@ struct editorConfig {
   unsigned int numrows;    /* Number of rows */
   int rawmode;             /* Is terminal raw mode enabled? */
   erow *row;               /* Rows */
-  int dirty;               /* File modified but not saved. */
+  uint64_t hash;           /* Sum of the position mixed row hashes. */
+  uint64_t savedhash;      /* 'hash' when the file was loaded or saved, */
+  uint64_t *savedrow;      /* the row hashes, */
+  unsigned int savedrows;  /* the number of rows, */
+  off_t savedsize;         /* and the size and mtime of the file. */
+  struct timespec savedmtime;
   char *filename;          /* Currently open filename */
+  int swapfd;              /* Recovery journal, -1 if not journaling. */
+  char *swapname;          /* Its filename: ".<filename>.ki-swp" */
   char statusmsg[80];
 };
 enum KEY_ACTION {
@@ -62,13 +83,56 @@ enum KEY_ACTION {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  RESIZE, /* The window size changed, or a ki client reported it. */
+  HANGUP  /* The input went away. */
 };
 
 void editorSetStatusMessage(const char *fmt, ...);
+void editorMoveCursor(int key);
+int editorReadKey(int fd);
+static void editorServerWait(int fd);
+void editorProcessKey(int c);
+void editorWindowChanged(void);
+void swapOpen(void);
+void swapReset(void);
+void editorInvalidateScreen(void);
+void editorInsertRows(unsigned int at, const erow *rows, unsigned int n);
+void editorRefreshScreen(void);
+void editorJumpTo(unsigned int line);
+void editorDiffClear(void);
+void editorMarkSaved(unsigned int from);
+int editorFileWasModified(void);
+void editorResize(unsigned int rows, unsigned int cols);
+void editorUncacheRows(unsigned int from, unsigned int to);
+void editorUncacheShifted(unsigned int at, unsigned int n, int up);
+void editorUncacheOutside(unsigned int rowoff, unsigned int rows);
+void initEditor(void);
+void editorFreeBuffer(void);
+static void swapLog(unsigned int op, unsigned int row, unsigned int col,
+                    const char *s, unsigned int len);
+/* Journal operations, see the swap file implementation. */
+enum SWAP_OP {
+  SWP_INSROW = 1, /* Insert row 'row' with the payload. */
+  SWP_DELROW,     /* Delete 'col' rows starting at 'row'. */
+  SWP_INSCHAR,    /* Insert the payload byte at row, col. */
+  SWP_DELCHAR,    /* Delete the byte at row, col. */
+  SWP_APPEND,     /* Append the payload to row. */
+  SWP_TRUNC,      /* Truncate row at col. */
+  SWP_SETROW      /* Replace the content of row with the payload. */
+};
 /* ======================= Low level terminal handling ====================== */
-static struct editorConfig E;
+static struct editorConfig E;      /* The current buffer. */
+static struct editorConfig *bufs;  /* All the open buffers: bufs[curbuf] */
+static unsigned int nbufs, curbuf; /* is stale while E is in use. */
 static int mode;
+static int server;             /* Running as 'ki --server'? */
+static int listenfd = -1;      /* The server socket, to turn clients away. */
+static int quit;               /* 1 if the user quit, -1 if the input
+                                  went away. */
+static int headless;           /* Running a script with 'ki -s'? */
+static unsigned int replaying; /* Depth of the macros being replayed. */
+static volatile sig_atomic_t winch; /* The terminal was resized. */
 static struct termios orig_termios; /* In order to restore at exit.*/
 
 void disableRawMode(int fd) {
@@ -120,31 +184,77 @@ fatal:
   return -1;
 }
 
+/* Read a byte waiting at most 'ms' milliseconds, as the terminal does in
+ * raw mode: the input may also be a ki client socket. Returns 1 if a byte
+ * was read. */
+static int editorReadTimeout(int fd, char *c, int ms) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  return poll(&pfd, 1, ms) == 1 && read(fd, c, 1) == 1;
+}
+
+/* Write all of 's', going on after a signal. Returns 0, or -1 on error. */
+static int writeAll(int fd, const char *s, size_t len) {
+  while (len) {
+    ssize_t n = write(fd, s, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    s += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
 /* Read a key from the terminal put in raw mode, trying to handle
- * escape sequences. */
+ * escape sequences. A resize, even one that came while we were drawing,
+ * is applied and returned as RESIZE, for the caller to redraw. */
 int editorReadKey(int fd) {
   ssize_t nread;
   char c, seq[3];
-  while ((nread = read(fd, &c, 1L)) == 0)
-    ;
-  if (nread == -1)
+  if (server)
+    editorServerWait(fd);
+  do {
+    if (winch) {
+      editorWindowChanged();
+      return RESIZE;
+    }
+    nread = read(fd, &c, 1L);
+  } while ((nread == 0 && E.rawmode) || (nread == -1 && errno == EINTR));
+  if (nread == -1 && !server)
     exit(1);
+  if (nread <= 0) {
+    quit = -1;
+    return HANGUP;
+  }
 
   while (1) {
     switch (c) {
     case ESC: /* escape sequence */
       /* If this is just an ESC, we'll timeout here. */
-      if (read(fd, seq, 1) == 0)
+      if (!editorReadTimeout(fd, seq, 100))
         return ESC;
-      if (read(fd, seq + 1, 1) == 0)
+      if (!editorReadTimeout(fd, seq + 1, 100))
         return ESC;
 
       /* ESC [ sequences. */
       if (seq[0] == '[') {
         if (seq[1] >= '0' && seq[1] <= '9') {
           /* Extended escape, read additional byte. */
-          if (read(fd, seq + 2, 1) == 0)
+          if (!editorReadTimeout(fd, seq + 2, 100))
             return ESC;
+          if (seq[1] == '8' && seq[2] == ';') {
+            /* Window size from a ki client: ESC [ 8 ; rows ; cols t */
+            char sz[32];
+            unsigned int i = 0, rows, cols;
+            while (i < sizeof(sz) - 1 && editorReadTimeout(fd, sz + i, 100) &&
+                   sz[i] != 't')
+              i++;
+            sz[i] = '\0';
+            if (sscanf(sz, "%u;%u", &rows, &cols) == 2)
+              editorResize(rows, cols);
+            return RESIZE;
+          }
           if (seq[2] == '~') {
             switch (seq[1]) {
             case '3':
@@ -262,16 +372,272 @@ failed:
   return -1;
 }
 
+/* ============================== Row allocator ============================= */
+
+/* The content of the rows of all the buffers comes from a shared pool:
+ * blocks of a few size classes, carved from big slabs and recycled through
+ * a free list per class, so rows stay packed together instead of being
+ * spread in the heap, and a row growing by a few bytes usually fits the
+ * block it already has. Blocks above the biggest class come from malloc().
+ *
+ * Blocks are reference counted, so that rows and registers can share the
+ * same content: rowShare() takes a reference, rowFree() drops one, and a
+ * row must call rowOwn() (or rowRealloc()) before writing to its content,
+ * which copies it if it is shared. */
+#define ARENA_SLAB (1 << 20)
+#define ARENA_BIG 0xff /* Class of the blocks allocated with malloc(). */
+#define ARENA_MAXREFS ((1u << 24) - 1) /* Past it rowShare() copies. */
+
+static const unsigned int arena_class[] = {16,  32,  48,   64,   96,   128,
+                                           192, 256, 384,  512,  768,  1024,
+                                           1536, 2048, 3072, 4096};
+#define ARENA_CLASSES (sizeof(arena_class) / sizeof(arena_class[0]))
+
+/* Every block starts with this header. */
+struct blockhdr {
+  uint32_t size;      /* Bytes usable after the header. */
+  unsigned cls : 8;   /* Index in arena_class[], or ARENA_BIG. */
+  unsigned refs : 24; /* Rows and registers using the block. */
+};
+
+static struct {
+  pthread_mutex_t lock;          /* Substitute workers allocate too. */
+  char *free[ARENA_CLASSES];     /* Free blocks, linked by their payload. */
+  char *slab;                    /* Slab new blocks are carved from, */
+  size_t slabused;               /* and how much of it is used. */
+  size_t saved;                  /* Bytes not allocated thanks to sharing. */
+} arena = {.lock = PTHREAD_MUTEX_INITIALIZER, .slabused = ARENA_SLAB};
+
+static struct blockhdr rowBlockHeader(const char *p) {
+  struct blockhdr h;
+  memcpy(&h, p - sizeof(h), sizeof(h));
+  return h;
+}
+
+/* Size class of a block of 'size' bytes, ARENA_CLASSES if none fits. */
+static unsigned int rowClass(size_t size) {
+  unsigned int cls;
+
+  for (cls = 0; cls < ARENA_CLASSES; cls++)
+    if (arena_class[cls] >= size)
+      break;
+  return cls;
+}
+
+/* Take a block of class 'cls' from its free list, or carve it from the
+ * slab. Called with the lock held; the header is written by the caller. */
+static char *rowTake(unsigned int cls) {
+  size_t need = sizeof(struct blockhdr) + arena_class[cls];
+  char *p = arena.free[cls];
+
+  if (p) {
+    memcpy(&arena.free[cls], p, sizeof(p));
+    return p;
+  }
+  if (arena.slabused + need > ARENA_SLAB) {
+    /* The tail of the old slab is too small for this class: leave it. */
+    if ((arena.slab = malloc(ARENA_SLAB)) == NULL) {
+      perror("Out of memory");
+      exit(1);
+    }
+    arena.slabused = 0;
+  }
+  p = arena.slab + arena.slabused + sizeof(struct blockhdr);
+  arena.slabused += need;
+  return p;
+}
+
+/* Write the header of a fresh block of class 'cls'. */
+static char *rowInitBlock(char *p, unsigned int cls) {
+  struct blockhdr h = {arena_class[cls], cls & 0xff, 1};
+  memcpy(p - sizeof(h), &h, sizeof(h));
+  return p;
+}
+
+/* Allocate room for 'size' bytes of row content. */
+char *rowAlloc(size_t size) {
+  unsigned int cls = rowClass(size);
+  char *p;
+
+  if (cls == ARENA_CLASSES) {
+    struct blockhdr h = {0, ARENA_BIG, 1};
+    if (size > UINT32_MAX || (p = malloc(sizeof(h) + size)) == NULL) {
+      perror("Out of memory");
+      exit(1);
+    }
+    h.size = (uint32_t)size;
+    memcpy(p, &h, sizeof(h));
+    return p + sizeof(h);
+  }
+  pthread_mutex_lock(&arena.lock);
+  p = rowTake(cls);
+  pthread_mutex_unlock(&arena.lock);
+  return rowInitBlock(p, cls);
+}
+
+/* Drop a reference to 'p'. Called with the lock held. */
+static void rowRelease(char *p) {
+  struct blockhdr h = rowBlockHeader(p);
+  if (h.refs > 1) {
+    h.refs--;
+    arena.saved -= sizeof(h) + h.size;
+    memcpy(p - sizeof(h), &h, sizeof(h));
+  } else if (h.cls == ARENA_BIG) {
+    free(p - sizeof(h));
+  } else {
+    memcpy(p, &arena.free[h.cls], sizeof(p));
+    arena.free[h.cls] = p;
+  }
+}
+
+/* Drop a reference to a block from rowAlloc(), releasing it with the
+ * last one. */
+void rowFree(char *p) {
+  if (p == NULL)
+    return;
+  pthread_mutex_lock(&arena.lock);
+  rowRelease(p);
+  pthread_mutex_unlock(&arena.lock);
+}
+
+/* rowFree() the 'n' blocks in 'p', taking the lock once. */
+void rowFreeMany(char **p, unsigned int n) {
+  pthread_mutex_lock(&arena.lock);
+  for (unsigned int j = 0; j < n; j++)
+    if (p[j])
+      rowRelease(p[j]);
+  pthread_mutex_unlock(&arena.lock);
+}
+
+/* Threads allocating many blocks, the substitute workers, take them from
+ * the arena ARENA_BATCH at a time into a cache of their own, so that they
+ * don't fight for the lock on every row. */
+#define ARENA_BATCH 64
+
+struct rowcache {
+  char *free[ARENA_CLASSES]; /* Blocks taken but not used yet. */
+};
+
+/* rowAlloc() through the cache 'c', that only its thread uses. */
+char *rowCacheAlloc(struct rowcache *c, size_t size) {
+  unsigned int cls = rowClass(size);
+  char *p;
+
+  if (cls == ARENA_CLASSES)
+    return rowAlloc(size);
+  if (c->free[cls] == NULL) {
+    pthread_mutex_lock(&arena.lock);
+    for (unsigned int j = 0; j < ARENA_BATCH; j++) {
+      p = rowTake(cls);
+      memcpy(p, &c->free[cls], sizeof(p));
+      c->free[cls] = p;
+    }
+    pthread_mutex_unlock(&arena.lock);
+  }
+  p = c->free[cls];
+  memcpy(&c->free[cls], p, sizeof(p));
+  return rowInitBlock(p, cls);
+}
+
+/* Give the blocks left in the cache 'c' back to the arena. */
+void rowCacheRelease(struct rowcache *c) {
+  pthread_mutex_lock(&arena.lock);
+  for (unsigned int cls = 0; cls < ARENA_CLASSES; cls++) {
+    char *p;
+    while ((p = c->free[cls]) != NULL) {
+      memcpy(&c->free[cls], p, sizeof(p));
+      memcpy(p, &arena.free[cls], sizeof(p));
+      arena.free[cls] = p;
+    }
+  }
+  pthread_mutex_unlock(&arena.lock);
+}
+
+/* Take a reference to the block 'p', to use it without copying it. */
+char *rowShare(char *p) {
+  pthread_mutex_lock(&arena.lock);
+  struct blockhdr h = rowBlockHeader(p);
+  int full = h.refs == ARENA_MAXREFS;
+  if (!full) {
+    h.refs++;
+    arena.saved += sizeof(h) + h.size;
+    memcpy(p - sizeof(h), &h, sizeof(h));
+  }
+  pthread_mutex_unlock(&arena.lock);
+  if (full) {
+    char *copy = rowAlloc(h.size);
+    memcpy(copy, p, h.size);
+    return copy;
+  }
+  return p;
+}
+
+/* Make sure that the block 'p' has room for 'size' bytes and is not
+ * shared, so that it can be written. Moves it only if it has to. */
+char *rowRealloc(char *p, size_t size) {
+  if (p == NULL)
+    return rowAlloc(size);
+  pthread_mutex_lock(&arena.lock);
+  struct blockhdr h = rowBlockHeader(p);
+  pthread_mutex_unlock(&arena.lock);
+  if (h.size >= size && h.refs == 1)
+    return p;
+  char *new = rowAlloc(size > h.size ? size : h.size);
+  memcpy(new, p, h.size);
+  rowFree(p);
+  return new;
+}
+
+/* Make the block 'p' writable, copying it if it is shared. */
+char *rowOwn(char *p) { return p ? rowRealloc(p, 0) : NULL; }
+
 /* ======================= Editor rows implementation ======================= */
 
-/* Update the row */
-void editorUpdateRow(erow *row) {
+/* FNV-1a, used to hash rows and screen lines. */
+static uint64_t editorHash(const char *s, size_t len) {
+  uint64_t h = 14695981039346656037UL;
+  while (len--)
+    h = (h ^ (unsigned char)*s++) * 1099511628211UL;
+  return h;
+}
+
+/* Contribution of a row to the buffer hash E.hash, depending on its
+ * position so that moving rows around changes the sum. */
+static uint64_t editorRowMix(uint64_t h, unsigned int idx) {
+  h ^= idx * 0x9E3779B97F4A7C15UL;
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9UL;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBUL;
+  return h ^ (h >> 31);
+}
+
+/* Drop the render of a row, it is built again when the row is drawn. */
+void editorRowUncache(erow *row) {
+  free(row->render);
+  free(row->hl);
+  row->render = NULL;
+  row->hl = NULL;
+  row->rsize = 0;
+}
+
+/* Update the hash of a row after its content changed, dropping its render
+ * and its :diff mark. Touches nothing but the row, so it can be used on
+ * rows not in the file yet, and from worker threads. */
+void editorHashRow(erow *row) {
+  row->hash = editorHash(row->chars, row->size);
+  row->mark = PRINTABLE;
+  editorRowUncache(row);
+}
+
+/* Build the render of a row if it is not cached. Only the rows that get
+ * drawn are rendered, so loading a file costs no render at all. */
+void editorRenderRow(erow *row) {
   unsigned int tabs = 0, nonprint = 0;
   unsigned int j, idx;
 
+  if (row->render)
+    return;
   /* Create a version of the row we can directly print on the screen,
    * respecting tabs, substituting non printable characters with '?'. */
-  free(row->render);
   for (j = 0; j < row->size; j++)
     if (row->chars[j] == TAB)
       tabs++;
@@ -296,73 +662,113 @@ void editorUpdateRow(erow *row) {
   row->rsize = idx;
   row->render[idx] = '\0';
 
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, PRINTABLE, row->rsize);
+  row->hl = malloc(row->rsize + 1);
+  memset(row->hl, row->mark, row->rsize + 1);
+}
+
+/* Update the row after its content changed, and the buffer hash with it:
+ * the file is modified only as long as the buffer hash differs from the
+ * one of the saved file, so changes that are undone by hand don't count. */
+void editorUpdateRow(erow *row) {
+  uint64_t old = row->hash;
+
+  editorHashRow(row);
+  E.hash += editorRowMix(row->hash, row->idx) - editorRowMix(old, row->idx);
+}
+
+/* Fill a new row, not yet part of the file, with a copy of 's'. */
+void editorInitRow(erow *row, const char *s, unsigned int len) {
+  row->size = len;
+  row->chars = rowAlloc(len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  row->hl = NULL;
+  row->render = NULL;
+  row->rsize = 0;
+  row->idx = 0;
+  editorHashRow(row);
 }
 
 /* Insert a row at the specified position, shifting the other rows on the bottom
  * if required. */
 void editorInsertRow(unsigned int at, const char *s, unsigned int len) {
+  erow row;
+
   if (at > E.numrows)
     return;
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  if (at != E.numrows) {
-    memmove(E.row + at + 1, E.row + at, sizeof(E.row[0]) * (E.numrows - at));
-    for (unsigned int j = at + 1; j <= E.numrows; j++)
-      E.row[j].idx++;
+  editorInitRow(&row, s, len);
+  editorInsertRows(at, &row, 1);
+}
+
+/* Insert 'n' rows built with editorInitRow() at the specified position,
+ * with a single shift of the rows below. The rows are owned by the file
+ * from now on. */
+void editorInsertRows(unsigned int at, const erow *rows, unsigned int n) {
+  if (at > E.numrows || !n)
+    return;
+  for (unsigned int j = 0; j < n; j++)
+    swapLog(SWP_INSROW, at + j, 0, rows[j].chars, rows[j].size);
+  editorUncacheShifted(at, n, 0);
+  E.row = realloc(E.row, sizeof(erow) * (E.numrows + n));
+  memmove(E.row + at + n, E.row + at, sizeof(E.row[0]) * (E.numrows - at));
+  memcpy(E.row + at, rows, sizeof(erow) * n);
+  E.numrows += n;
+  for (unsigned int j = at; j < E.numrows; j++) {
+    if (j >= at + n)
+      E.hash -= editorRowMix(E.row[j].hash, E.row[j].idx);
+    E.row[j].idx = j;
+    E.hash += editorRowMix(E.row[j].hash, j);
   }
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len + 1);
-  E.row[at].hl = NULL;
-  E.row[at].render = NULL;
-  E.row[at].rsize = 0;
-  E.row[at].idx = at;
-  editorUpdateRow(E.row + at);
-  E.numrows++;
-  E.dirty++;
 }
 
 /* Free row's heap allocated stuff. */
 void editorFreeRow(erow *row) {
   free(row->render);
-  free(row->chars);
+  rowFree(row->chars);
   free(row->hl);
 }
 
-/* Remove the row at the specified position, shifting the remainign on the
- * top. */
-void editorDelRow(unsigned int at) {
-  erow *row;
-
-  if (at >= E.numrows)
+/* Remove 'n' rows starting at the specified position, shifting the
+ * remaining on the top. */
+void editorDelRows(unsigned int at, unsigned int n) {
+  if (at >= E.numrows || n > E.numrows - at || !n)
     return;
-  row = E.row + at;
-  editorFreeRow(row);
-  memmove(E.row + at, E.row + at + 1, sizeof(E.row[0]) * (E.numrows - at - 1));
-  for (unsigned int j = at; j < E.numrows - 1; j++)
-    E.row[j].idx++;
-  E.numrows--;
-  E.dirty++;
+  swapLog(SWP_DELROW, at, n, NULL, 0);
+  for (unsigned int j = at; j < at + n; j++) {
+    E.hash -= editorRowMix(E.row[j].hash, j);
+    editorFreeRow(E.row + j);
+  }
+  editorUncacheShifted(at + n, n, 1);
+  memmove(E.row + at, E.row + at + n,
+          sizeof(E.row[0]) * (E.numrows - at - n));
+  E.numrows -= n;
+  for (unsigned int j = at; j < E.numrows; j++) {
+    E.hash += editorRowMix(E.row[j].hash, j) -
+              editorRowMix(E.row[j].hash, E.row[j].idx);
+    E.row[j].idx = j;
+  }
 }
 
-/* Turn the editor rows into a single heap-allocated string.
- * Returns the pointer to the heap-allocated string and populate the
- * integer pointed by 'buflen' with the size of the string, escluding
- * the final nulterm. */
-char *editorRowsToString(unsigned int *buflen) {
+/* Remove the row at the specified position. */
+void editorDelRow(unsigned int at) { editorDelRows(at, 1); }
+
+/* Turn the editor rows, starting at row 'from', into a single
+ * heap-allocated string. Returns the pointer to the heap-allocated string
+ * and populate the integer pointed by 'buflen' with the size of the string,
+ * escluding the final nulterm. */
+char *editorRowsToString(unsigned int from, unsigned int *buflen) {
   char *buf = NULL, *p;
   unsigned int totlen = 0;
   unsigned int j;
 
   /* Compute count of bytes */
-  for (j = 0; j < E.numrows; j++)
+  for (j = from; j < E.numrows; j++)
     totlen += E.row[j].size + 1; /* +1 is for "\n" at end of every row */
   *buflen = totlen;
   totlen++; /* Also make space for nulterm */
 
   p = buf = malloc(totlen);
-  for (j = 0; j < E.numrows; j++) {
+  for (j = from; j < E.numrows; j++) {
     memcpy(p, E.row[j].chars, E.row[j].size);
     p += E.row[j].size;
     *p = '\n';
@@ -375,45 +781,70 @@ char *editorRowsToString(unsigned int *buflen) {
 /* Insert a character at the specified position in a row, moving the remaining
  * chars on the right if needed. */
 void editorRowInsertChar(erow *row, unsigned int at, int c) {
+  char ch = (char)c;
+
+  swapLog(SWP_INSCHAR, row->idx, at, &ch, 1);
   if (at > row->size) {
     /* Pad the string with spaces if the insert location is outside the
      * current length by more than a single character. */
     unsigned int padlen = at - row->size;
     /* In the next line +2 means: new char and null term. */
-    row->chars = realloc(row->chars, row->size + padlen + 2);
+    row->chars = rowRealloc(row->chars, row->size + padlen + 2);
     memset(row->chars + row->size, ' ', padlen);
     row->chars[row->size + padlen + 1] = '\0';
     row->size += padlen + 1;
   } else {
     /* If we are in the middle of the string just make space for 1 new
      * char plus the (already existing) null term. */
-    row->chars = realloc(row->chars, row->size + 2);
+    row->chars = rowRealloc(row->chars, row->size + 2);
     memmove(row->chars + at + 1, row->chars + at, row->size - at + 1);
     row->size++;
   }
-  row->chars[at] = (char)c;
+  row->chars[at] = ch;
   editorUpdateRow(row);
-  E.dirty++;
 }
 
 /* Append the string 's' at the end of a row */
-void editorRowAppendString(erow *row, char *s, unsigned int len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
+void editorRowAppendString(erow *row, const char *s, unsigned int len) {
+  swapLog(SWP_APPEND, row->idx, 0, s, len);
+  row->chars = rowRealloc(row->chars, row->size + len + 1);
   memcpy(row->chars + row->size, s, len);
   row->size += len;
   row->chars[row->size] = '\0';
   editorUpdateRow(row);
-  E.dirty++;
 }
 
 /* Delete the character at offset 'at' from the specified row. */
 void editorRowDelChar(erow *row, unsigned int at) {
   if (row->size <= at)
     return;
+  swapLog(SWP_DELCHAR, row->idx, at, NULL, 0);
+  row->chars = rowOwn(row->chars);
   memmove(row->chars + at, row->chars + at + 1, row->size - at);
-  editorUpdateRow(row);
   row->size--;
-  E.dirty++;
+  editorUpdateRow(row);
+}
+
+/* Truncate the row at offset 'at'. */
+void editorRowTruncate(erow *row, unsigned int at) {
+  if (row->size <= at)
+    return;
+  swapLog(SWP_TRUNC, row->idx, at, NULL, 0);
+  row->chars = rowOwn(row->chars);
+  row->chars[at] = '\0';
+  row->size = at;
+  editorUpdateRow(row);
+}
+
+/* Replace the whole content of the row with 's'. */
+void editorRowSet(erow *row, const char *s, unsigned int len) {
+  swapLog(SWP_SETROW, row->idx, 0, s, len);
+  rowFree(row->chars);
+  row->chars = rowAlloc(len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  row->size = len;
+  editorUpdateRow(row);
 }
 
 /* Insert the specified char at the current prompt position. */
@@ -434,7 +865,6 @@ void editorInsertChar(int c) {
     E.coloff++;
   else
     E.cx++;
-  E.dirty++;
 }
 
 /* Inserting a newline is slightly complex as we have to handle inserting a
@@ -460,10 +890,7 @@ void editorInsertNewline(void) {
   else {
     /* We are in the middle of a line. Split it between two rows. */
     editorInsertRow(filerow + 1, row->chars + filecol, row->size - filecol);
-    row = &E.row[filerow];
-    row->chars[filecol] = '\0';
-    row->size = filecol;
-    editorUpdateRow(row);
+    editorRowTruncate(&E.row[filerow], filecol);
   }
 fixcursor:
   if (E.cy == E.screenrows - 1)
@@ -508,15 +935,68 @@ void editorDelChar(void) {
   }
   if (row)
     editorUpdateRow(row);
-  E.dirty++;
+}
+
+/* With KI_INTERN=1 the rows of a file being loaded are interned: identical
+ * rows share the same content, see rowShare(), copied the first time one
+ * of them is written. Logs and generated files full of repeated lines take
+ * a fraction of the memory. */
+struct intern {
+  struct internslot {
+    uint64_t hash;
+    unsigned int size;
+    char *chars; /* NULL if the slot is free. */
+  } *slot;
+  unsigned int mask, used;
+};
+static int interning; /* Was KI_INTERN set? */
+
+/* Make 'row' share the content of an identical row seen before, or
+ * remember its content for the next ones. */
+static void editorIntern(struct intern *t, erow *row) {
+  unsigned int j;
+
+  if (t->used >= t->mask / 2) {
+    struct intern old = *t;
+
+    t->mask = old.mask ? old.mask * 2 + 1 : 1023;
+    t->slot = calloc(t->mask + 1, sizeof(t->slot[0]));
+    t->used = 0;
+    for (j = 0; old.slot && j <= old.mask; j++) {
+      if (!old.slot[j].chars)
+        continue;
+      unsigned int k = (unsigned int)old.slot[j].hash & t->mask;
+      while (t->slot[k].chars)
+        k = (k + 1) & t->mask;
+      t->slot[k] = old.slot[j];
+      t->used++;
+    }
+    free(old.slot);
+  }
+  for (j = (unsigned int)row->hash & t->mask; t->slot[j].chars;
+       j = (j + 1) & t->mask) {
+    struct internslot *s = t->slot + j;
+    if (s->hash == row->hash && s->size == row->size &&
+        !memcmp(s->chars, row->chars, row->size)) {
+      rowFree(row->chars);
+      row->chars = rowShare(s->chars);
+      return;
+    }
+  }
+  t->slot[j].hash = row->hash;
+  t->slot[j].size = row->size;
+  t->slot[j].chars = row->chars;
+  t->used++;
 }
 
 /* Load the specified program in the editor memory and returns 0 on success
  * or 1 on error. */
 int editorOpen(char *filename) {
+  char *env = getenv("KI_INTERN");
+  struct intern t = {NULL, 0, 0};
   FILE *fp;
 
-  E.dirty = 0;
+  interning = env && atoi(env) > 0;
   free(E.filename);
   size_t fnlen = strlen(filename) + 1;
   E.filename = malloc(fnlen);
@@ -525,9 +1005,15 @@ int editorOpen(char *filename) {
   fp = fopen(filename, "r");
   if (!fp) {
     if (errno != ENOENT) {
-      perror("Opening file");
-      exit(1);
+      if (!server && nbufs <= 1) { /* Nothing else to edit. */
+        perror("Opening file");
+        exit(1);
+      }
+      editorSetStatusMessage("Can't open! %s", strerror(errno));
+      return 1;
     }
+    editorMarkSaved(0);
+    swapOpen();
     return 1;
   }
 
@@ -535,35 +1021,99 @@ int editorOpen(char *filename) {
   size_t linecap = 0;
   ssize_t linelen;
   while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    erow row;
+
     if (linelen && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
       line[--linelen] = '\0';
-    editorInsertRow(E.numrows, line, (unsigned int)linelen);
+    editorInitRow(&row, line, (unsigned int)linelen);
+    if (interning)
+      editorIntern(&t, &row);
+    editorInsertRows(E.numrows, &row, 1);
   }
+  free(t.slot);
   free(line);
   fclose(fp);
-  E.dirty = 0;
+  editorMarkSaved(0);
+  swapOpen();
   return 0;
 }
 
-/* Save the current file on disk. Return 0 on success, 1 on error. */
+/* The buffer now matches the file on disk: remember its hashes, of which
+ * the ones of the rows before 'from' did not change. */
+void editorMarkSaved(unsigned int from) {
+  struct stat st;
+
+  E.savedhash = E.hash;
+  E.savedrows = E.numrows;
+  E.savedrow = realloc(E.savedrow, sizeof(uint64_t) * (E.numrows + 1));
+  for (unsigned int j = from; j < E.numrows; j++)
+    E.savedrow[j] = E.row[j].hash;
+  E.savedsize = -1;
+  if (stat(E.filename, &st) == 0) {
+    E.savedsize = st.st_size;
+    E.savedmtime = st.st_mtim;
+  }
+}
+
+/* Does the buffer 'b' differ from its file on disk? */
+int editorBufferWasModified(const struct editorConfig *b) {
+  return b->numrows != b->savedrows || b->hash != b->savedhash;
+}
+
+/* Does the current buffer differ from the file on disk? */
+int editorFileWasModified(void) { return editorBufferWasModified(&E); }
+
+/* Save the current file on disk. Return 0 on success, 1 on error.
+ * Nothing is written if the buffer is the same as the file, and only the
+ * rows after the unchanged prefix are if the file is still the one we
+ * loaded or saved. */
 int editorSave(void) {
-  unsigned int len;
-  char *buf = editorRowsToString(&len);
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+  unsigned int len, from = 0;
+  off_t off = 0;
+  struct stat st;
+  char *buf;
+  int fd;
+
+  if (stat(E.filename, &st) == 0 && st.st_size == E.savedsize &&
+      st.st_mtim.tv_sec == E.savedmtime.tv_sec &&
+      st.st_mtim.tv_nsec == E.savedmtime.tv_nsec) {
+    if (!editorFileWasModified()) {
+      swapReset();
+      editorDiffClear();
+      editorSetStatusMessage("No changes, nothing written");
+      return 0;
+    }
+    while (from < E.numrows && from < E.savedrows &&
+           E.row[from].hash == E.savedrow[from])
+      from++;
+    /* The last row of the file may have no newline. */
+    if (from && from == E.savedrows)
+      from--;
+    for (unsigned int j = 0; j < from; j++)
+      off += E.row[j].size + 1;
+  }
+  buf = editorRowsToString(from, &len);
+  fd = open(E.filename, O_RDWR | O_CREAT, 0644);
   if (fd == -1)
     goto writeerr;
 
   /* Use truncate + a single write(2) call in order to make saving
    * a bit safer, under the limits of what we can do in a small editor. */
-  if (ftruncate(fd, len) == -1)
+  if (ftruncate(fd, off + len) == -1)
     goto writeerr;
-  if ((unsigned int)write(fd, buf, len) != len)
+  if ((unsigned int)pwrite(fd, buf, len, off) != len)
     goto writeerr;
 
   close(fd);
   free(buf);
-  E.dirty = 0;
-  editorSetStatusMessage("%d bytes written on disk", len);
+  editorMarkSaved(from);
+  swapReset();
+  editorDiffClear();
+  if (from)
+    editorSetStatusMessage("%u bytes written on disk, from line %u", len,
+                           from + 1);
+  else
+    editorSetStatusMessage("%u bytes written on disk", len);
   return 0;
 
 writeerr:
@@ -574,166 +1124,1245 @@ writeerr:
   return 1;
 }
 
-/* ============================= Terminal update ============================ */
+/* ======================== Swap file (crash recovery) ====================== */
+
+/* Every edit is appended to a journal next to the file, ".<file>.ki-swp",
+ * as a checksummed record: crash protection costs a few bytes per edit
+ * instead of rewriting the file. Records are buffered and written before
+ * waiting for the next key, and a background thread fsyncs the journal
+ * every KI_SWAPSYNC seconds (0 means after every write). The journal is
+ * reset when the file is saved and removed on quit, so a leftover one
+ * means the previous session did not end cleanly. */
+#define SWP_MAGIC "ki-swp1"
+#define SWP_SYNC_SECS 2
+#define SWP_BUFSIZE 65536
+#define SWP_MAXFILES 16
+
+/* The journal starts with a header identifying the file it applies to. */
+struct swphdr {
+  char magic[8];
+  int64_t size;  /* Size of the file when the journal was started. */
+  int64_t mtime; /* Its modification time. */
+};
 
-/* We define a very simple "append buffer" structure, that is an heap
- * allocated string where we can append to. This is useful in order to
- * write all the escape sequences in a buffer and flush them to the standard
- * output in a single call, to avoid flickering effects. */
-struct abuf {
-  char *b;
-  unsigned int len;
+/* Every record is followed by 'len' bytes of payload. */
+struct swprec {
+  uint32_t op, row, col, len;
+  uint32_t sum; /* Checksum of the fields above and of the payload. */
 };
 
-#define ABUF_INIT {NULL, 0}
+static struct {
+  char buf[SWP_BUFSIZE]; /* Records not written yet. */
+  unsigned int len;
+  int fd;                /* Journal the buffered records belong to. */
+  unsigned int interval; /* Seconds between two fsyncs. */
+  int started;           /* Was the sync thread started? */
+  pthread_t tid;
+  pthread_mutex_t lock;       /* Protects unsynced[] from the sync thread. */
+  int unsynced[SWP_MAXFILES]; /* Journals written since the last fsync. */
+  unsigned int nunsynced;
+} swp = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* FNV-1a of the record header and payload. */
+static uint32_t swapSum(const struct swprec *r, const char *s) {
+  const unsigned char *p = (const unsigned char *)r;
+  uint32_t h = 2166136261u;
+  unsigned int j;
 
-void abAppend(struct abuf *ab, const char *s, unsigned int len) {
-  char *new = (char *)realloc(ab->b, ab->len + len);
+  for (j = 0; j < 4 * sizeof(uint32_t); j++)
+    h = (h ^ p[j]) * 16777619u;
+  for (j = 0; j < r->len; j++)
+    h = (h ^ (unsigned char)s[j]) * 16777619u;
+  return h;
+}
 
-  if (!new)
+static void *swapSyncThread(void *arg __attribute__((unused))) {
+  while (swp.interval) {
+    sleep(swp.interval);
+    pthread_mutex_lock(&swp.lock);
+    for (unsigned int j = 0; j < swp.nunsynced; j++)
+      fdatasync(swp.unsynced[j]);
+    swp.nunsynced = 0;
+    pthread_mutex_unlock(&swp.lock);
+  }
+  return NULL;
+}
+
+/* Start the background sync thread, the first time a journal is opened. */
+static void swapStartSync(void) {
+  char *env = getenv("KI_SWAPSYNC");
+  sigset_t all, old;
+
+  if (swp.started)
     return;
-  memcpy(new + ab->len, s, len);
-  ab->b = new;
-  ab->len += len;
+  swp.started = 1;
+  swp.interval = env ? (unsigned int)strtoul(env, NULL, 10) : SWP_SYNC_SECS;
+  if (!swp.interval)
+    return;
+  /* Signals, SIGWINCH above all, must be handled by the main thread. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  if (pthread_create(&swp.tid, NULL, swapSyncThread, NULL) != 0)
+    swp.interval = 0; /* Sync after every write instead. */
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
 }
 
-// void abFree(struct abuf *ab) {
-//     free(ab->b);
-// }
-#define abFree(x) free((x)->b)
-/* This function writes the whole screen using VT100 escape characters
- * starting from the logical state of the editor in the global state 'E'. */
-void editorRefreshScreen(void) {
-  unsigned int y;
-  erow *r;
-  char buf[32];
-  struct abuf ab = ABUF_INIT;
+/* Queue the journal for the next background fsync. */
+static void swapMarkUnsynced(int fd) {
+  unsigned int j;
 
-  abAppend(&ab, "\x1b[?25l", 6); /* Hide cursor. */
-  abAppend(&ab, "\x1b[H", 3);    /* Go home. */
-  for (y = 0; y < E.screenrows; y++) {
-    unsigned int filerow = E.rowoff + y;
-    if (filerow >= E.numrows) {
-      abAppend(&ab, "~\x1b[0K\r\n", 7);
-      continue;
-    }
+  if (!swp.interval) {
+    fdatasync(fd);
+    return;
+  }
+  pthread_mutex_lock(&swp.lock);
+  for (j = 0; j < swp.nunsynced && swp.unsynced[j] != fd; j++)
+    ;
+  if (j == SWP_MAXFILES)
+    fdatasync(fd);
+  else if (j == swp.nunsynced)
+    swp.unsynced[swp.nunsynced++] = fd;
+  pthread_mutex_unlock(&swp.lock);
+}
 
-    r = &E.row[filerow];
-
-    unsigned int len = r->rsize - E.coloff;
-    if (len > 0) {
-      if (len > E.screencols)
-        len = E.screencols;
-      char *c = r->render + E.coloff;
-      unsigned char *hl = r->hl + E.coloff;
-      unsigned int j;
-      for (j = 0; j < len; j++) {
-        if (hl[j] == NONPRINTABLE) {
-          char sym;
-          abAppend(&ab, "\x1b[7m", 4);
-          if (c[j] <= 26)
-            sym = '@' + c[j];
-          else
-            sym = '?';
-          abAppend(&ab, &sym, 1);
-          abAppend(&ab, "\x1b[0m", 4);
-        } else
-          abAppend(&ab, c + j, 1);
-      }
-    }
-    abAppend(&ab, "\x1b[39m", 5);
-    abAppend(&ab, "\x1b[0K", 4);
-    abAppend(&ab, "\r\n", 2);
+/* Stop journaling the current file and remove its journal. */
+void swapClose(void) {
+  unsigned int j;
+
+  if (E.swapfd == -1)
+    return;
+  if (swp.fd == E.swapfd) {
+    swp.len = 0;
+    swp.fd = -1;
   }
+  pthread_mutex_lock(&swp.lock);
+  for (j = 0; j < swp.nunsynced; j++)
+    if (swp.unsynced[j] == E.swapfd)
+      swp.unsynced[j--] = swp.unsynced[--swp.nunsynced];
+  pthread_mutex_unlock(&swp.lock);
+  /* Unlink before closing, while the journal is still locked. */
+  unlink(E.swapname);
+  close(E.swapfd);
+  E.swapfd = -1;
+}
 
-  /* Create a two rows status. First row: */
-  abAppend(&ab, "\x1b[0K", 4);
-  abAppend(&ab, "\x1b[7m", 4);
-  char status[80], rstatus[80];
-  int err = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename,
-                     E.numrows, E.dirty ? "(modified)" : "");
-  if (err == -1)
-    exit(1);
-  unsigned int len = (unsigned int)err;
-  err = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.rowoff + E.cy + 1,
-                 E.numrows);
-  if (err == -1)
-    exit(1);
-  unsigned int rlen = (unsigned int)err;
-  if (len > E.screencols)
-    len = E.screencols;
-  abAppend(&ab, status, len);
-  while (len < E.screencols) {
-    if (E.screencols - len == rlen) {
-      abAppend(&ab, rstatus, rlen);
-      break;
-    } else {
-      abAppend(&ab, " ", 1);
-      len++;
+/* A journal we can't write is worse than none. */
+static void swapFail(void) {
+  editorSetStatusMessage("Swap file disabled! I/O error: %s",
+                         strerror(errno));
+  swapClose();
+}
+
+/* Write the buffered records to the journal. */
+void swapFlush(void) {
+  char *p = swp.buf;
+
+  while (swp.len) {
+    ssize_t n = write(swp.fd, p, swp.len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      swapFail();
+      return;
     }
+    p += n;
+    swp.len -= (unsigned int)n;
   }
-  abAppend(&ab, "\x1b[0m\r\n", 6);
+  if (p != swp.buf)
+    swapMarkUnsynced(swp.fd);
+}
 
-  /* Second row depends on E.statusmsg and the status message update time. */
-  abAppend(&ab, "\x1b[0K", 4);
-  size_t s_msglen = strlen(E.statusmsg);
-  if (s_msglen >= UINT_MAX)
-    exit(1);
-  unsigned int msglen = (unsigned int)s_msglen;
-  if (msglen)
-    abAppend(&ab, E.statusmsg, msglen <= E.screencols ? msglen : E.screencols);
+/* Append a record to the journal of the current file. */
+static void swapLog(unsigned int op, unsigned int row, unsigned int col,
+                    const char *s, unsigned int len) {
+  struct swprec r = {op, row, col, len, 0};
 
-  /* Put cursor at its current position. Note that the horizontal position
-   * at which the cursor is displayed may be different compared to 'E.cx'
-   * because of TABs. */
-  unsigned int j;
-  unsigned int cx = 1;
-  unsigned int filerow = E.rowoff + E.cy;
-  erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
-  if (row) {
-    for (j = E.coloff; j < (E.cx + E.coloff); j++) {
-      if (j < row->size && row->chars[j] == TAB)
-        cx += 7 - ((cx) % 8);
-      cx++;
+  if (E.swapfd == -1)
+    return;
+  if (swp.fd != E.swapfd) {
+    swapFlush();
+    swp.fd = E.swapfd;
+  }
+  r.sum = swapSum(&r, s);
+  if (swp.len + sizeof(r) + len > SWP_BUFSIZE) {
+    swapFlush();
+    if (sizeof(r) + len > SWP_BUFSIZE) {
+      /* Too big to be buffered: write it right away. */
+      struct iovec iov[2] = {{&r, sizeof(r)},
+                             {(void *)(uintptr_t)s, len}};
+      if (writev(E.swapfd, iov, 2) != (ssize_t)(sizeof(r) + len))
+        swapFail();
+      else
+        swapMarkUnsynced(E.swapfd);
+      return;
     }
   }
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy + 1, cx);
-  size_t slen = strlen(buf);
-  if (slen >= UINT_MAX)
-    exit(1);
-  unsigned int ulen = (unsigned int)slen;
-  abAppend(&ab, buf, ulen);
-  abAppend(&ab, "\x1b[?25h", 6); /* Show cursor. */
-  if (-1 == write(STDOUT_FILENO, ab.b, ab.len))
-    exit(-1);
-  abFree(&ab);
+  memcpy(swp.buf + swp.len, &r, sizeof(r));
+  swp.len += (unsigned int)sizeof(r);
+  if (len)
+    memcpy(swp.buf + swp.len, s, len);
+  swp.len += len;
 }
 
-/* Set an editor status message for the second line of the status, at the
- * end of the screen. */
-__attribute__((format(printf, 1, 2))) void
-editorSetStatusMessage(const char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-  va_end(ap);
+/* Start over with an empty journal, matching the file now on disk. */
+void swapReset(void) {
+  struct swphdr h = {SWP_MAGIC, 0, 0};
+  struct stat st;
+
+  if (E.swapfd == -1)
+    return;
+  if (swp.fd == E.swapfd)
+    swp.len = 0;
+  if (stat(E.filename, &st) == 0) {
+    h.size = st.st_size;
+    h.mtime = st.st_mtime;
+  }
+  if (ftruncate(E.swapfd, 0) == -1 ||
+      write(E.swapfd, &h, sizeof(h)) != (ssize_t)sizeof(h))
+    swapFail();
+  else
+    swapMarkUnsynced(E.swapfd);
 }
-/* ========================= Editor events handling  ======================== */
 
-/* Handle cursor position change because arrow keys were pressed. */
-void editorMoveCursor(int key) {
-  unsigned int filerow = E.rowoff + E.cy;
-  unsigned int filecol = E.coloff + E.cx;
-  unsigned int rowlen;
-  erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+/* Apply a journal record to the rows. Returns -1 if it does not fit the
+ * current content. */
+static int swapApply(const struct swprec *r, const char *s) {
+  erow *row = r->row < E.numrows ? E.row + r->row : NULL;
 
-  switch (key) {
-  case ARROW_LEFT:
-    if (E.cx == 0) {
-      if (E.coloff)
-        E.coloff--;
-      else {
-        if (filerow > 0) {
+  if (!row && r->op != SWP_INSROW)
+    return -1;
+  switch (r->op) {
+  case SWP_INSROW:
+    if (r->row > E.numrows)
+      return -1;
+    editorInsertRow(r->row, s, r->len);
+    break;
+  case SWP_DELROW:
+    if (r->col > E.numrows - r->row)
+      return -1;
+    editorDelRows(r->row, r->col);
+    break;
+  case SWP_INSCHAR:
+    if (r->len != 1)
+      return -1;
+    editorRowInsertChar(row, r->col, *s);
+    break;
+  case SWP_DELCHAR:
+    editorRowDelChar(row, r->col);
+    break;
+  case SWP_APPEND:
+    editorRowAppendString(row, s, r->len);
+    break;
+  case SWP_TRUNC:
+    editorRowTruncate(row, r->col);
+    break;
+  case SWP_SETROW:
+    editorRowSet(row, s, r->len);
+    break;
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+/* Replay the journal on top of the loaded file, stopping at the first
+ * torn or corrupted record. Returns the offset after the last good one. */
+static off_t swapReplay(int fd, off_t end) {
+  size_t size = (size_t)end, off = sizeof(struct swphdr);
+  char *buf = malloc(size);
+  unsigned long n = 0;
+  struct swprec r;
+
+  if (pread(fd, buf, size, 0) != end)
+    size = 0;
+  while (off + sizeof(r) <= size) {
+    memcpy(&r, buf + off, sizeof(r));
+    if (r.len > size - off - sizeof(r) ||
+        swapSum(&r, buf + off + sizeof(r)) != r.sum ||
+        swapApply(&r, buf + off + sizeof(r)) == -1)
+      break;
+    off += sizeof(r) + r.len;
+    n++;
+  }
+  free(buf);
+  editorSetStatusMessage("Recovered %lu edits from %s", n, E.swapname);
+  return (off_t)off;
+}
+
+/* Ask whether to replay a leftover journal: returns 1 for yes, 0 for no,
+ * -1 if there is nobody to ask. */
+static int swapAsk(int changed) {
+  char msg[256];
+  int len;
+
+  if (!E.rawmode && !server)
+    return -1;
+  len = snprintf(msg, sizeof(msg),
+                 "\r\nFound swap file %s%s.\r\n"
+                 "Recover the unsaved changes? (y/n) ",
+                 E.swapname, changed ? " (the file changed since!)" : "");
+  if (len < 0 || writeAll(STDOUT_FILENO, msg, (size_t)len) == -1)
+    return -1;
+  while (1) {
+    int c = editorReadKey(STDIN_FILENO);
+    if (c == 'y' || c == 'Y' || c == HANGUP) /* Keep it if in doubt. */
+      return 1;
+    if (c == 'n' || c == 'N' || c == ESC)
+      return 0;
+  }
+}
+
+/* Start journaling the current file. If the previous session left its
+ * journal behind, offer to replay it. */
+void swapOpen(void) {
+  struct swphdr h = {SWP_MAGIC, 0, 0}, old;
+  char *base = strrchr(E.filename, '/');
+  int dirlen = base ? (int)(base - E.filename) + 1 : 0;
+  size_t namelen = strlen(E.filename) + sizeof(".ki-swp") + 1;
+  struct stat st, named;
+  off_t end;
+  int fd, answer;
+
+  if (headless)
+    return; /* A script can just be run again. */
+  swapStartSync();
+  free(E.swapname);
+  E.swapname = malloc(namelen);
+  snprintf(E.swapname, namelen, "%.*s.%s.ki-swp", dirlen, E.filename,
+           base ? base + 1 : E.filename);
+  /* The journal is locked by its owner for as long as it is in use: a
+   * second ki, or a second buffer on the same file, neither shares it nor
+   * replays it. A journal unlinked by its owner between our open() and
+   * our lock is not the one in place anymore: try again. */
+  while (1) {
+    fd = open(E.swapname, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1) {
+      editorSetStatusMessage("No swap file! %s", strerror(errno));
+      return;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1 && errno == EWOULDBLOCK) {
+      close(fd);
+      editorSetStatusMessage("No swap file! %.40s is in use by another ki",
+                             E.swapname);
+      return;
+    }
+    if (fstat(fd, &st) == 0 && stat(E.swapname, &named) == 0 &&
+        st.st_dev == named.st_dev && st.st_ino == named.st_ino)
+      break;
+    close(fd);
+  }
+  if (stat(E.filename, &st) == 0) {
+    h.size = st.st_size;
+    h.mtime = st.st_mtime;
+  }
+  end = lseek(fd, 0, SEEK_END);
+  answer = end > (off_t)sizeof(h) &&
+                   pread(fd, &old, sizeof(old), 0) == (ssize_t)sizeof(old) &&
+                   !memcmp(old.magic, SWP_MAGIC, sizeof(old.magic))
+               ? swapAsk(old.size != h.size || old.mtime != h.mtime)
+               : 0;
+  if (answer == -1) {
+    /* Nobody said the changes can go: keep them for a session that can
+     * ask, and go without a journal. */
+    close(fd);
+    editorSetStatusMessage("No swap file! %.40s is left to recover",
+                           E.swapname);
+    return;
+  }
+  if (answer) {
+    /* Drop any torn tail, new records must follow the good ones. */
+    if (ftruncate(fd, swapReplay(fd, end)) == -1) {
+      close(fd);
+      return;
+    }
+    E.swapfd = fd;
+    return;
+  }
+  E.swapfd = fd;
+  swapReset();
+}
+
+/* ========================== Filter (:range!cmd) =========================== */
+
+/* Rows are streamed to the command with writev(), FILTER_IOV rows at a
+ * time, while its output is read concurrently and split into new rows as
+ * it arrives, so the only extra memory is the output itself. */
+#define FILTER_IOV 512
+
+struct filter {
+  unsigned int next, end; /* Next row to send, last row to send. */
+  unsigned int sent;      /* Bytes of row 'next' already sent. */
+  erow *rows;             /* Output rows. */
+  unsigned int nrows, cap;
+  char *pend; /* Output line not terminated yet. */
+  unsigned int pendlen;
+};
+
+/* Send the command as many rows as the pipe takes. Returns 1 when it
+ * takes no more, because we are done or because it stopped reading, -1 on
+ * a write error. */
+static int editorFilterWrite(struct filter *f, int fd) {
+  struct iovec iov[FILTER_IOV * 2];
+  unsigned int k = 0, r;
+  ssize_t n;
+
+  /* Up to two iovecs per row: its content and the newline. */
+  for (r = f->next; r <= f->end && k + 2 <= FILTER_IOV * 2; r++) {
+    unsigned int off = r == f->next ? f->sent : 0;
+    if (off < E.row[r].size)
+      iov[k++] = (struct iovec){E.row[r].chars + off, E.row[r].size - off};
+    iov[k++] = (struct iovec){(void *)(uintptr_t) "\n", 1};
+  }
+  n = writev(fd, iov, (int)k);
+  if (n == -1) {
+    if (errno == EAGAIN || errno == EINTR)
+      return 0;
+    return errno == EPIPE ? 1 : -1; /* EPIPE: it exited, as head(1) does. */
+  }
+  while (n > 0) {
+    unsigned int left = E.row[f->next].size + 1 - f->sent;
+    if ((size_t)n < left) {
+      f->sent += (unsigned int)n;
+      break;
+    }
+    n -= left;
+    f->sent = 0;
+    f->next++;
+  }
+  return f->next > f->end ? 1 : 0;
+}
+
+/* Turn output of the command into rows. */
+static void editorFilterRead(struct filter *f, const char *s, size_t len) {
+  const char *nl;
+
+  while (len) {
+    nl = memchr(s, '\n', len);
+    size_t linelen = nl ? (size_t)(nl - s) : len;
+    f->pend = realloc(f->pend, f->pendlen + linelen + 1);
+    memcpy(f->pend + f->pendlen, s, linelen);
+    f->pendlen += (unsigned int)linelen;
+    if (!nl)
+      return;
+    if (f->nrows == f->cap) {
+      f->cap = f->cap ? f->cap * 2 : 64;
+      f->rows = realloc(f->rows, sizeof(erow) * f->cap);
+    }
+    editorInitRow(f->rows + f->nrows++, f->pend, f->pendlen);
+    f->pendlen = 0;
+    s += linelen + 1;
+    len -= linelen + 1;
+  }
+}
+
+/* Keep the first line the command wrote on its standard error, for the
+ * status message. */
+static void editorFilterError(char *msg, size_t size, const char *s,
+                              size_t len) {
+  size_t have = strlen(msg);
+
+  if (have + 1 < size && !memchr(msg, '\n', have)) {
+    if (len > size - have - 1)
+      len = size - have - 1;
+    memcpy(msg + have, s, len);
+    msg[have + len] = '\0';
+  }
+}
+
+/* Replace rows [start, end] with the output of 'cmd' run with them as its
+ * standard input. ESC cancels, leaving the rows as they were, and so does
+ * a command that fails: ki has no undo. What the command writes on its
+ * standard error never goes in the buffer, its first line is shown. */
+void editorFilter(unsigned int start, unsigned int end, const char *cmd) {
+  struct filter f = {start, end, 0, NULL, 0, 0, NULL, 0};
+  struct sigaction ign = {0}, oldpipe;
+  int in[2] = {-1, -1}, out[2] = {-1, -1}, err[2] = {-1, -1};
+  int status = 0, cancelled = 0;
+  int error = 0; /* errno of a failed write to the command. */
+  char buf[65536], msg[128] = "";
+  pid_t pid = -1;
+
+  /* An empty buffer can only get the output at its start. */
+  if (end >= E.numrows)
+    f.end = end = E.numrows ? E.numrows - 1 : 0;
+  if (start > end || (!E.numrows && start)) {
+    editorSetStatusMessage("Invalid range");
+    return;
+  }
+  if (!E.numrows)
+    f.next = 1; /* Nothing to send. */
+  if (pipe(in) == -1 || pipe(out) == -1 || pipe(err) == -1 ||
+      (pid = fork()) == -1) {
+    editorSetStatusMessage("Can't filter! %s", strerror(errno));
+    for (unsigned int j = 0; j < 2; j++) {
+      if (in[j] != -1)
+        close(in[j]);
+      if (out[j] != -1)
+        close(out[j]);
+      if (err[j] != -1)
+        close(err[j]);
+    }
+    return;
+  }
+  if (pid == 0) {
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    close(err[0]);
+    close(err[1]);
+    /* The server ignores SIGPIPE: without it "yes | head" never ends. */
+    signal(SIGPIPE, SIG_DFL);
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    _exit(127);
+  }
+  close(in[0]);
+  close(out[1]);
+  close(err[1]);
+  fcntl(in[1], F_SETFL, O_NONBLOCK);
+  /* A command that does not read all its input must not kill us. */
+  ign.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &ign, &oldpipe);
+
+  editorSetStatusMessage("Filtering through %s... (ESC cancels)", cmd);
+  editorRefreshScreen();
+  if (f.next > f.end) {
+    close(in[1]);
+    in[1] = -1;
+  }
+  while (1) {
+    /* poll() skips the negative fds: keys are only read when someone is
+     * typing them, and the input pipe once it is closed. */
+    struct pollfd pfd[4] = {{out[0], POLLIN, 0},
+                            {E.rawmode || server ? STDIN_FILENO : -1,
+                             POLLIN, 0},
+                            {in[1], POLLOUT, 0},
+                            {err[0], POLLIN, 0}};
+    if (poll(pfd, 4, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (pfd[1].revents & (POLLIN | POLLHUP)) {
+      int c = editorReadKey(STDIN_FILENO);
+      if (c == ESC || c == HANGUP) {
+        cancelled = 1;
+        kill(pid, SIGTERM);
+        break;
+      }
+    }
+    if (in[1] != -1 && pfd[2].revents) {
+      int done = editorFilterWrite(&f, in[1]);
+      if (done == -1) {
+        error = errno;
+        cancelled = 1;
+        kill(pid, SIGTERM);
+        break;
+      }
+      if (done) {
+        close(in[1]); /* Done, or the command won't read more: EOF. */
+        in[1] = -1;
+      }
+    }
+    if (err[0] != -1 && pfd[3].revents) {
+      ssize_t n = read(err[0], buf, sizeof(buf));
+      if (n > 0)
+        editorFilterError(msg, sizeof(msg), buf, (size_t)n);
+      else if (n == 0 || errno != EINTR) {
+        close(err[0]);
+        err[0] = -1;
+      }
+    }
+    if (pfd[0].revents) {
+      ssize_t n = read(out[0], buf, sizeof(buf));
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      editorFilterRead(&f, buf, (size_t)n);
+    }
+  }
+  if (in[1] != -1)
+    close(in[1]);
+  close(out[0]);
+  waitpid(pid, &status, 0);
+  sigaction(SIGPIPE, &oldpipe, NULL);
+  if (err[0] != -1) { /* What is left of the errors, without blocking. */
+    ssize_t n;
+    fcntl(err[0], F_SETFL, O_NONBLOCK);
+    while ((n = read(err[0], buf, sizeof(buf))) > 0)
+      editorFilterError(msg, sizeof(msg), buf, (size_t)n);
+    close(err[0]);
+  }
+  msg[strcspn(msg, "\n")] = '\0';
+
+  if (!cancelled && f.pendlen) /* Last line without a newline. */
+    editorFilterRead(&f, "\n", 1);
+  free(f.pend);
+  if (cancelled || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    for (unsigned int j = 0; j < f.nrows; j++)
+      editorFreeRow(f.rows + j);
+    free(f.rows);
+    if (error)
+      editorSetStatusMessage("Can't filter! %s", strerror(error));
+    else if (cancelled)
+      editorSetStatusMessage("Filter cancelled");
+    else if (WIFEXITED(status))
+      editorSetStatusMessage("Lines left alone: exit status %d. %s",
+                             WEXITSTATUS(status), msg);
+    else
+      editorSetStatusMessage("Lines left alone: killed by signal %d. %s",
+                             WTERMSIG(status), msg);
+    return;
+  }
+  if (E.numrows)
+    editorDelRows(start, end - start + 1);
+  editorInsertRows(start, f.rows, f.nrows);
+  free(f.rows);
+  editorJumpTo(start);
+  editorSetStatusMessage("%u lines from %s", f.nrows, cmd);
+}
+
+/* =============================== Diff (:diff) ============================= */
+
+/* Compare the rows with the file on disk. Every line is hashed to an
+ * integer first, so that the diff itself only compares integers. The
+ * common prefix and suffix are trimmed, then Myers' O(ND) algorithm is run
+ * in its linear space variant: find the middle snake of the optimal path,
+ * recurse on both sides. Rows not in the file are marked DIFFCHANGED. */
+
+struct diff {
+  const uint64_t *a, *b; /* Lines of the file, rows of the buffer. */
+  long *vf, *vb;         /* Forward and backward furthest reaching paths. */
+  unsigned long added, deleted, hunks;
+  long lastb; /* Where the last change ended, to merge adjacent ones. */
+};
+
+/* Find a point on an optimal path from (left, top) to (right, bottom),
+ * other than the two corners: the end of the middle snake. */
+static void diffSplit(struct diff *d, long left, long right, long top,
+                      long bottom, long *sx, long *sy) {
+  long w = right - left, h = bottom - top, delta = w - h;
+  long max = (w + h + 1) / 2, x, y, k, c, p;
+  long *vf = d->vf + max + 1, *vb = d->vb + max + 1;
+
+  *sx = left + (w + 1) / 2; /* Not reached, but a split that makes */
+  *sy = top + h / 2;        /* progress anyway. */
+  vf[1] = left;
+  vb[1] = bottom;
+  for (long e = 0; e <= max; e++) {
+    /* Forward, along the diagonals k = x - y. */
+    for (k = e; k >= -e; k -= 2) {
+      c = k - delta;
+      if (k == -e || (k != e && vf[k - 1] < vf[k + 1]))
+        x = p = vf[k + 1];
+      else {
+        p = vf[k - 1];
+        x = p + 1;
+      }
+      y = top + (x - left) - k;
+      while (x < right && y < bottom && d->a[x] == d->b[y])
+        x++, y++;
+      vf[k] = x;
+      if ((delta & 1) && c >= -(e - 1) && c <= e - 1 && y >= vb[c]) {
+        *sx = x;
+        *sy = y;
+        return;
+      }
+    }
+    /* Backward, along the diagonals c = k - delta. */
+    for (c = e; c >= -e; c -= 2) {
+      k = c + delta;
+      if (c == -e || (c != e && vb[c - 1] > vb[c + 1]))
+        y = p = vb[c + 1];
+      else {
+        p = vb[c - 1];
+        y = p - 1;
+      }
+      x = left + (y - top) + k;
+      while (x > left && y > top && d->a[x - 1] == d->b[y - 1])
+        x--, y--;
+      vb[c] = y;
+      if (!(delta & 1) && k >= -e && k <= e && x <= vf[k]) {
+        *sx = x;
+        *sy = y;
+        return;
+      }
+    }
+  }
+}
+
+/* Diff a[alo, ahi) with b[blo, bhi). */
+static void diffCompare(struct diff *d, long alo, long ahi, long blo,
+                        long bhi) {
+  long x, y;
+
+  while (alo < ahi && blo < bhi && d->a[alo] == d->b[blo])
+    alo++, blo++;
+  while (alo < ahi && blo < bhi && d->a[ahi - 1] == d->b[bhi - 1])
+    ahi--, bhi--;
+  if (alo == ahi && blo == bhi)
+    return;
+  if (alo == ahi || blo == bhi) {
+    if (blo != d->lastb)
+      d->hunks++;
+    d->lastb = bhi;
+    d->deleted += (unsigned long)(ahi - alo);
+    d->added += (unsigned long)(bhi - blo);
+    for (; blo < bhi; blo++) {
+      E.row[blo].mark = DIFFCHANGED;
+      editorRowUncache(E.row + blo);
+    }
+    return;
+  }
+  diffSplit(d, alo, ahi, blo, bhi, &x, &y);
+  diffCompare(d, alo, x, blo, y);
+  diffCompare(d, x, ahi, y, bhi);
+}
+
+/* Remove the marks of a previous :diff. */
+void editorDiffClear(void) {
+  for (unsigned int j = 0; j < E.numrows; j++) {
+    erow *row = E.row + j;
+    if (row->mark == DIFFCHANGED) {
+      row->mark = PRINTABLE;
+      editorRowUncache(row);
+    }
+  }
+}
+
+/* Mark the rows changed since the file on disk, and sum it up. */
+void editorDiff(void) {
+  struct diff d = {NULL, NULL, NULL, NULL, 0, 0, 0, -1};
+  struct timespec t0, t1;
+  uint64_t *a = NULL, *b;
+  size_t n = 0, cap = 0, linecap = 0;
+  char *line = NULL;
+  ssize_t linelen;
+  FILE *fp;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  fp = fopen(E.filename, "r");
+  if (!fp && errno != ENOENT) {
+    editorSetStatusMessage("Can't diff! %s", strerror(errno));
+    return;
+  }
+  /* Lines are split as editorOpen() does. */
+  while (fp && (linelen = getline(&line, &linecap, fp)) != -1) {
+    if (linelen && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+      linelen--;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 1024;
+      a = realloc(a, sizeof(uint64_t) * cap);
+    }
+    a[n++] = editorHash(line, (size_t)linelen);
+  }
+  free(line);
+  if (fp)
+    fclose(fp);
+  b = malloc(sizeof(uint64_t) * (E.numrows + 1));
+  for (unsigned int j = 0; j < E.numrows; j++)
+    b[j] = E.row[j].hash;
+
+  /* Trim here already, so that the paths are sized for the middle only. */
+  long alo = 0, blo = 0, ahi = (long)n, bhi = (long)E.numrows;
+  while (alo < ahi && blo < bhi && a[alo] == b[blo])
+    alo++, blo++;
+  while (alo < ahi && blo < bhi && a[ahi - 1] == b[bhi - 1])
+    ahi--, bhi--;
+  size_t vsize = (size_t)((ahi - alo + bhi - blo + 1) / 2) * 2 + 3;
+  d.a = a;
+  d.b = b;
+  d.vf = malloc(sizeof(long) * vsize);
+  d.vb = malloc(sizeof(long) * vsize);
+  editorDiffClear();
+  diffCompare(&d, alo, ahi, blo, bhi);
+  free(d.vf);
+  free(d.vb);
+  free(a);
+  free(b);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  double ms = (double)(t1.tv_sec - t0.tv_sec) * 1e3 +
+              (double)(t1.tv_nsec - t0.tv_nsec) / 1e6;
+  if (!d.hunks)
+    editorSetStatusMessage("No changes (%.3f ms)", ms);
+  else
+    editorSetStatusMessage("%lu hunks: +%lu -%lu lines (%.3f ms)", d.hunks,
+                           d.added, d.deleted, ms);
+}
+
+/* ============================ Substitute (:s) ============================= */
+
+/* Rows are split into contiguous slices, one per worker thread. Slices
+ * smaller than SUB_MINROWS are not worth a thread. */
+#define SUB_MAXTHREADS 64
+#define SUB_MINROWS 4096
+
+struct subjob {
+  pthread_t tid;
+  unsigned int start, end; /* Rows [start, end) handled by this worker. */
+  const char *old, *new;
+  unsigned int oldlen, newlen;
+  int global;            /* Replace every match, not only the first. */
+  unsigned long matches; /* Number of replacements done. */
+  unsigned int *changed; /* Rows changed, to be journaled, */
+  char **dropped;        /* and their old content, to be freed. */
+  unsigned int nchanged, maxchanged;
+  uint64_t hash;         /* Change of the buffer hash. */
+  struct rowcache cache; /* Blocks for the new rows. */
+};
+
+/* Rewrite the rows of a slice. Every worker only touches its own rows, so
+ * no locking is needed: the new row is counted first, then built with a
+ * single allocation from the private cache of the worker and swapped in.
+ * The old content may be shared with rows of other slices, so the caller
+ * frees it once all the workers are done. */
+static void *editorSubWorker(void *arg) {
+  struct subjob *job = arg;
+
+  for (unsigned int j = job->start; j < job->end; j++) {
+    erow *row = &E.row[j];
+    char *p = row->chars, *end = row->chars + row->size, *m;
+    unsigned long n = 0;
+
+    while ((m = memmem(p, (size_t)(end - p), job->old, job->oldlen))) {
+      n++;
+      p = m + job->oldlen;
+      if (!job->global)
+        break;
+    }
+    if (!n)
+      continue;
+
+    unsigned long len = row->size - n * job->oldlen + n * job->newlen;
+    char *buf = rowCacheAlloc(&job->cache, len + 1), *d = buf;
+    p = row->chars;
+    for (unsigned long k = 0; k < n; k++) {
+      m = memmem(p, (size_t)(end - p), job->old, job->oldlen);
+      memcpy(d, p, (size_t)(m - p));
+      d += m - p;
+      memcpy(d, job->new, job->newlen);
+      d += job->newlen;
+      p = m + job->oldlen;
+    }
+    memcpy(d, p, (size_t)(end - p));
+    buf[len] = '\0';
+    if (job->nchanged == job->maxchanged) {
+      job->maxchanged = job->maxchanged ? job->maxchanged * 2 : 256;
+      job->changed =
+          realloc(job->changed, sizeof(unsigned int) * job->maxchanged);
+      job->dropped = realloc(job->dropped, sizeof(char *) * job->maxchanged);
+    }
+    job->changed[job->nchanged] = j;
+    job->dropped[job->nchanged++] = row->chars;
+    row->chars = buf;
+    row->size = (unsigned int)len;
+    uint64_t old = row->hash;
+    editorHashRow(row);
+    job->hash += editorRowMix(row->hash, j) - editorRowMix(old, j);
+    job->matches += n;
+  }
+  return NULL;
+}
+
+/* Split the next 'delim' terminated field of a s/old/new/ command, handling
+ * backslash escapes in place. Returns a pointer past the delimiter, or NULL
+ * if the string ended first. */
+static char *editorSubField(char *s, char delim, unsigned int *len) {
+  char *field = s, *d = s, *next;
+
+  while (*s && *s != delim) {
+    if (*s == '\\' && (s[1] == delim || s[1] == '\\'))
+      s++;
+    *d++ = *s++;
+  }
+  next = *s ? s + 1 : NULL;
+  *d = '\0';
+  *len = (unsigned int)(d - field);
+  return next;
+}
+
+/* Replace 'old' with 'new' in rows [start, end], splitting the work across
+ * the available cores. All the rows are committed at once, and the
+ * caller redraws once. */
+void editorSubstitute(unsigned int start, unsigned int end, char *args) {
+  struct subjob jobs[SUB_MAXTHREADS];
+  struct timespec t0, t1;
+  unsigned int oldlen, newlen, nthreads, slice, j;
+  unsigned long matches = 0;
+  char delim = *args, *old, *new, *flags;
+
+  if (!delim || isalnum((unsigned char)delim) || delim == '\\' ||
+      delim == ' ') {
+    editorSetStatusMessage("Usage: [range]s/old/new/[g]");
+    return;
+  }
+  old = args + 1;
+  new = editorSubField(old, delim, &oldlen);
+  if (!new || !oldlen) {
+    editorSetStatusMessage("Usage: [range]s/old/new/[g]");
+    return;
+  }
+  flags = editorSubField(new, delim, &newlen);
+  if (end >= E.numrows)
+    end = E.numrows - 1;
+  if (!E.numrows || start > end) {
+    editorSetStatusMessage("Pattern not found: %s", old);
+    return;
+  }
+
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  nthreads = ncpu < 1 ? 1 : (unsigned int)ncpu;
+  if (nthreads > SUB_MAXTHREADS)
+    nthreads = SUB_MAXTHREADS;
+  if ((end - start + 1) / nthreads < SUB_MINROWS)
+    nthreads = (end - start + 1) / SUB_MINROWS;
+  if (!nthreads)
+    nthreads = 1;
+  slice = (end - start + 1) / nthreads;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (j = 0; j < nthreads; j++) {
+    struct subjob *job = jobs + j;
+    job->start = start + j * slice;
+    job->end = j == nthreads - 1 ? end + 1 : job->start + slice;
+    job->old = old;
+    job->oldlen = oldlen;
+    job->new = new;
+    job->newlen = newlen;
+    job->global = flags && strchr(flags, 'g') != NULL;
+    job->matches = 0;
+    job->changed = NULL;
+    job->dropped = NULL;
+    job->nchanged = job->maxchanged = 0;
+    job->hash = 0;
+    memset(&job->cache, 0, sizeof(job->cache));
+    /* The last slice runs on this thread, as does any slice we could not
+     * spawn a thread for. */
+    if (j == nthreads - 1 || pthread_create(&job->tid, NULL, editorSubWorker,
+                                            job) != 0) {
+      editorSubWorker(job);
+      job->tid = pthread_self();
+    }
+  }
+  for (j = 0; j < nthreads; j++) {
+    if (!pthread_equal(jobs[j].tid, pthread_self()))
+      pthread_join(jobs[j].tid, NULL);
+    matches += jobs[j].matches;
+    E.hash += jobs[j].hash;
+    for (unsigned int k = 0; k < jobs[j].nchanged && E.swapfd != -1; k++) {
+      erow *row = E.row + jobs[j].changed[k];
+      swapLog(SWP_SETROW, row->idx, 0, row->chars, row->size);
+    }
+    rowFreeMany(jobs[j].dropped, jobs[j].nchanged);
+    rowCacheRelease(&jobs[j].cache);
+    free(jobs[j].changed);
+    free(jobs[j].dropped);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  if (!matches) {
+    editorSetStatusMessage("Pattern not found: %s", old);
+    return;
+  }
+  editorMoveCursor(0); /* The current row may have shrunk: fix cx. */
+  double ms = (double)(t1.tv_sec - t0.tv_sec) * 1e3 +
+              (double)(t1.tv_nsec - t0.tv_nsec) / 1e6;
+  editorSetStatusMessage("%lu substitutions on %u threads in %.3f ms",
+                         matches, nthreads, ms);
+}
+
+/* ============================= Terminal update ============================ */
+
+/* We define a very simple "append buffer" structure, that is an heap
+ * allocated string where we can append to. This is useful in order to
+ * write all the escape sequences in a buffer and flush them to the standard
+ * output in a single call, to avoid flickering effects. */
+struct abuf {
+  char *b;
+  unsigned int len;
+};
+
+#define ABUF_INIT {NULL, 0}
+
+void abAppend(struct abuf *ab, const char *s, unsigned int len) {
+  char *new = (char *)realloc(ab->b, ab->len + len);
+
+  if (!new)
+    return;
+  memcpy(new + ab->len, s, len);
+  ab->b = new;
+  ab->len += len;
+}
+
+// void abFree(struct abuf *ab) {
+//     free(ab->b);
+// }
+#define abFree(x) free((x)->b)
+
+/* What the text area of the terminal currently shows, so that a refresh
+ * only draws the rows that changed. Small scrolls are done by the terminal
+ * itself, inside a scroll region, and only the rows exposed get drawn. */
+static struct {
+  unsigned long *hash; /* Hash of the line drawn on each screen row, 0 if
+                          unknown. */
+  unsigned int rows;   /* Number of entries in hash[]. */
+  unsigned int rowoff; /* E.rowoff of the drawn screen. */
+} screen;
+
+/* Drop the render of the rows from 'from' to 'to' (excluded), if they
+ * exist: row renders are only cached while on screen. */
+void editorUncacheRows(unsigned int from, unsigned int to) {
+  for (; from < to && from < E.numrows; from++)
+    editorRowUncache(E.row + from);
+}
+
+/* The rows from 'at' on are about to move 'n' rows down, or up if 'up':
+ * drop the render of the drawn ones that the move takes off the screen. */
+void editorUncacheShifted(unsigned int at, unsigned int n, int up) {
+  unsigned int top = screen.rowoff, bottom = screen.rowoff + screen.rows;
+  unsigned int from = at > top ? at : top;
+
+  if (up)
+    editorUncacheRows(from, screen.rows > n ? top + n : bottom);
+  else if (screen.rows > n && from < bottom - n)
+    editorUncacheRows(bottom - n, bottom);
+  else
+    editorUncacheRows(from, bottom);
+}
+
+/* The text area is about to show 'rows' rows from 'rowoff': drop the
+ * render of the drawn rows it leaves out. */
+void editorUncacheOutside(unsigned int rowoff, unsigned int rows) {
+  unsigned int top = screen.rowoff, bottom = screen.rowoff + screen.rows;
+
+  if (rowoff > top)
+    editorUncacheRows(top, rowoff < bottom ? rowoff : bottom);
+  if (rowoff + rows < bottom)
+    editorUncacheRows(rowoff + rows > top ? rowoff + rows : top, bottom);
+}
+
+/* Forget what is on the screen: the next refresh repaints everything. */
+void editorInvalidateScreen(void) {
+  screen.rowoff = E.rowoff;
+  if (screen.rows != E.screenrows) {
+    screen.rows = E.screenrows;
+    screen.hash = realloc(screen.hash, sizeof(unsigned long) * screen.rows);
+  }
+  memset(screen.hash, 0, sizeof(unsigned long) * screen.rows);
+}
+
+/* Let the terminal scroll the text area to match E.rowoff, shifting the
+ * hashes of the drawn rows accordingly. The rows scrolled out of the screen
+ * lose their render. */
+static void editorScrollScreen(struct abuf *ab) {
+  unsigned int up = E.rowoff > screen.rowoff;
+  unsigned int n = up ? E.rowoff - screen.rowoff : screen.rowoff - E.rowoff;
+  unsigned int old = screen.rowoff;
+  unsigned long *h = screen.hash;
+  char buf[32];
+
+  screen.rowoff = E.rowoff;
+  if (!n)
+    return;
+  if (n >= screen.rows) {
+    editorUncacheRows(old, old + screen.rows);
+    editorInvalidateScreen();
+    return;
+  }
+  if (up)
+    editorUncacheRows(old, old + n);
+  else
+    editorUncacheRows(old + screen.rows - n, old + screen.rows);
+  /* Set the scroll region to the text area, scroll, reset the region. */
+  snprintf(buf, sizeof(buf), "\x1b[1;%ur\x1b[%u%c\x1b[r", screen.rows, n,
+           up ? 'S' : 'T');
+  abAppend(ab, buf, (unsigned int)strlen(buf));
+  if (up) {
+    memmove(h, h + n, sizeof(h[0]) * (screen.rows - n));
+    memset(h + screen.rows - n, 0, sizeof(h[0]) * n);
+  } else {
+    memmove(h + n, h, sizeof(h[0]) * (screen.rows - n));
+    memset(h, 0, sizeof(h[0]) * n);
+  }
+}
+
+/* Append to 'ab' the content of the screen row 'y'. */
+static void editorDrawRow(struct abuf *ab, unsigned int y) {
+  unsigned int filerow = E.rowoff + y;
+  erow *r;
+
+  if (filerow >= E.numrows) {
+    abAppend(ab, "~\x1b[0K", 5);
+    return;
+  }
+
+  r = &E.row[filerow];
+  editorRenderRow(r);
+
+  /* Rows changed since the file on disk get a green background, up to the
+   * end of the screen line. */
+  int changed = r->mark == DIFFCHANGED;
+  if (changed)
+    abAppend(ab, "\x1b[42m", 5);
+  unsigned int len = r->rsize > E.coloff ? r->rsize - E.coloff : 0;
+  if (len > 0) {
+    if (len > E.screencols)
+      len = E.screencols;
+    char *c = r->render + E.coloff;
+    unsigned char *hl = r->hl + E.coloff;
+    unsigned int j;
+    for (j = 0; j < len; j++) {
+      if (hl[j] == NONPRINTABLE) {
+        char sym;
+        abAppend(ab, "\x1b[7m", 4);
+        if (c[j] <= 26)
+          sym = '@' + c[j];
+        else
+          sym = '?';
+        abAppend(ab, &sym, 1);
+        abAppend(ab, "\x1b[0m", 4);
+        if (changed)
+          abAppend(ab, "\x1b[42m", 5);
+      } else
+        abAppend(ab, c + j, 1);
+    }
+  }
+  abAppend(ab, "\x1b[39m", 5);
+  abAppend(ab, "\x1b[0K", 4);
+  if (changed)
+    abAppend(ab, "\x1b[49m", 5);
+}
+
+/* This function writes the screen using VT100 escape characters starting
+ * from the logical state of the editor in the global state 'E'. */
+void editorRefreshScreen(void) {
+  unsigned int y;
+  char buf[32];
+  struct abuf ab = ABUF_INIT, line = ABUF_INIT;
+
+  if (replaying || headless)
+    return; /* Draw the result only. */
+  abAppend(&ab, "\x1b[?25l", 6); /* Hide cursor. */
+  if (screen.rows != E.screenrows)
+    editorInvalidateScreen();
+  editorScrollScreen(&ab);
+  for (y = 0; y < E.screenrows; y++) {
+    unsigned long h;
+
+    line.len = 0;
+    editorDrawRow(&line, y);
+    h = editorHash(line.b, line.len) | 1; /* 0 means unknown. */
+    if (screen.hash[y] == h)
+      continue;
+    screen.hash[y] = h;
+    snprintf(buf, sizeof(buf), "\x1b[%u;1H", y + 1);
+    abAppend(&ab, buf, (unsigned int)strlen(buf));
+    abAppend(&ab, line.b, line.len);
+  }
+  abFree(&line);
+
+  /* Create a two rows status. First row: */
+  snprintf(buf, sizeof(buf), "\x1b[%u;1H", E.screenrows + 1);
+  abAppend(&ab, buf, (unsigned int)strlen(buf));
+  abAppend(&ab, "\x1b[0K", 4);
+  abAppend(&ab, "\x1b[7m", 4);
+  char status[80], rstatus[80], saved[32] = "";
+  if (interning)
+    snprintf(saved, sizeof(saved), ", %luKB saved",
+             (unsigned long)arena.saved / 1024);
+  int err = snprintf(status, sizeof(status), "%.20s - %d lines%s %s",
+                     E.filename, E.numrows, saved,
+                     editorFileWasModified() ? "(modified)" : "");
+  if (err == -1)
+    exit(1);
+  unsigned int len = (unsigned int)err;
+  err = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.rowoff + E.cy + 1,
+                 E.numrows);
+  if (err == -1)
+    exit(1);
+  unsigned int rlen = (unsigned int)err;
+  if (len > E.screencols)
+    len = E.screencols;
+  abAppend(&ab, status, len);
+  while (len < E.screencols) {
+    if (E.screencols - len == rlen) {
+      abAppend(&ab, rstatus, rlen);
+      break;
+    } else {
+      abAppend(&ab, " ", 1);
+      len++;
+    }
+  }
+  abAppend(&ab, "\x1b[0m\r\n", 6);
+
+  /* Second row depends on E.statusmsg and the status message update time. */
+  abAppend(&ab, "\x1b[0K", 4);
+  size_t s_msglen = strlen(E.statusmsg);
+  if (s_msglen >= UINT_MAX)
+    exit(1);
+  unsigned int msglen = (unsigned int)s_msglen;
+  if (msglen)
+    abAppend(&ab, E.statusmsg, msglen <= E.screencols ? msglen : E.screencols);
+
+  /* Put cursor at its current position. Note that the horizontal position
+   * at which the cursor is displayed may be different compared to 'E.cx'
+   * because of TABs. */
+  unsigned int j;
+  unsigned int cx = 1;
+  unsigned int filerow = E.rowoff + E.cy;
+  erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+  if (row) {
+    for (j = E.coloff; j < (E.cx + E.coloff); j++) {
+      if (j < row->size && row->chars[j] == TAB)
+        cx += 7 - ((cx) % 8);
+      cx++;
+    }
+  }
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy + 1, cx);
+  size_t slen = strlen(buf);
+  if (slen >= UINT_MAX)
+    exit(1);
+  unsigned int ulen = (unsigned int)slen;
+  abAppend(&ab, buf, ulen);
+  abAppend(&ab, "\x1b[?25h", 6); /* Show cursor. */
+  if (writeAll(STDOUT_FILENO, ab.b, ab.len) == -1) {
+    if (!server)
+      exit(-1);
+    quit = -1; /* The client went away. */
+  }
+  abFree(&ab);
+}
+
+/* Set an editor status message for the second line of the status, at the
+ * end of the screen. */
+__attribute__((format(printf, 1, 2))) void
+editorSetStatusMessage(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+  va_end(ap);
+}
+/* ========================= Editor events handling  ======================== */
+
+/* Handle cursor position change because arrow keys were pressed. */
+void editorMoveCursor(int key) {
+  unsigned int filerow = E.rowoff + E.cy;
+  unsigned int filecol = E.coloff + E.cx;
+  unsigned int rowlen;
+  erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+
+  switch (key) {
+  case ARROW_LEFT:
+    if (E.cx == 0) {
+      if (E.coloff)
+        E.coloff--;
+      else {
+        if (filerow > 0) {
           E.cy--;
           E.cx = E.row[filerow - 1].size;
           if (E.cx > E.screencols - 1) {
@@ -786,42 +2415,596 @@ void editorMoveCursor(int key) {
     E.cx -= (filecol - rowlen);
 }
 
-/* Process events arriving from the standard input, which is, the user
- * is typing stuff on the terminal. */
+/* Move the cursor to the start of row 'line', centering it on the screen
+ * if it is not visible. Takes constant time whatever the distance. */
+void editorJumpTo(unsigned int line) {
+  if (line >= E.numrows)
+    line = E.numrows ? E.numrows - 1 : 0;
+  if (line < E.rowoff || line >= E.rowoff + E.screenrows)
+    E.rowoff = line > E.screenrows / 2 ? line - E.screenrows / 2 : 0;
+  E.cy = line - E.rowoff;
+  E.cx = 0;
+  E.coloff = 0;
+}
+
+/* Scroll a page up or down by moving the row offset directly. */
+void editorPage(int key) {
+  unsigned int last;
+
+  if (key == PAGE_UP) {
+    E.rowoff = E.rowoff > E.screenrows ? E.rowoff - E.screenrows : 0;
+    E.cy = 0;
+  } else {
+    /* Like moving down a page from the last row of the screen. */
+    last = E.rowoff + 2 * E.screenrows - 1;
+    if (last > E.numrows)
+      last = E.numrows;
+    E.cy = E.screenrows - 1;
+    if (last < E.cy)
+      E.cy = last;
+    E.rowoff = last - E.cy;
+  }
+  editorMoveCursor(0); /* Fix cx. */
+}
+
+/* ================================= Buffers ================================ */
+
+/* Keep the cursor on screen after a resize or a buffer switch. */
+static void editorClampCursor(void) {
+  if (E.cy >= E.screenrows) {
+    E.rowoff += E.cy - E.screenrows + 1;
+    E.cy = E.screenrows - 1;
+  }
+  if (E.cx >= E.screencols) {
+    E.coloff += E.cx - E.screencols + 1;
+    E.cx = E.screencols - 1;
+  }
+}
+
+/* Stash the current buffer in its slot. Its drawn rows drop their render:
+ * a hidden buffer keeps no render at all. */
+static void editorHideBuffer(void) {
+  editorUncacheRows(screen.rowoff, screen.rowoff + screen.rows);
+  bufs[curbuf] = E;
+}
+
+/* Make the buffer in slot 'n' the current one, keeping the terminal state
+ * where it is. Costs a redraw of the screen, whatever the file size. */
+static void editorLoadBuffer(unsigned int n) {
+  struct editorConfig term = E;
+
+  E = bufs[n];
+  E.screenrows = term.screenrows;
+  E.screencols = term.screencols;
+  E.rawmode = term.rawmode;
+  memcpy(E.statusmsg, term.statusmsg, sizeof(E.statusmsg));
+  curbuf = n;
+  editorClampCursor();
+  editorInvalidateScreen();
+}
+
+void editorSwitchBuffer(unsigned int n) {
+  if (n >= nbufs)
+    return;
+  if (n != curbuf) {
+    editorHideBuffer();
+    editorLoadBuffer(n);
+  }
+  editorSetStatusMessage("\"%.40s\" %u lines [%u/%u]", E.filename,
+                         E.numrows, curbuf + 1, nbufs);
+}
+
+/* Open 'filename' in a new buffer and make it the current one. */
+void editorAddBuffer(char *filename) {
+  if (nbufs)
+    editorHideBuffer();
+  bufs = realloc(bufs, sizeof(*bufs) * (nbufs + 1));
+  curbuf = nbufs++;
+  initEditor();
+  editorInvalidateScreen();
+  editorOpen(filename);
+}
+
+/* Slot of the buffer editing 'filename', or -1. Names of an existing
+ * file match if they lead to the same file, as "./a" and "a" do. */
+static int editorFindBuffer(const char *filename) {
+  struct stat st, bst;
+  int exists = stat(filename, &st) == 0;
+
+  for (unsigned int j = 0; j < nbufs; j++) {
+    const char *name = j == curbuf ? E.filename : bufs[j].filename;
+    if (!name)
+      continue;
+    if (!strcmp(name, filename) ||
+        (exists && stat(name, &bst) == 0 && bst.st_dev == st.st_dev &&
+         bst.st_ino == st.st_ino))
+      return (int)j;
+  }
+  return -1;
+}
+
+/* Did the file of the current buffer change on disk since we loaded or
+ * saved it? A file that is still missing did not. */
+static int editorFileIsStale(void) {
+  struct stat st;
+
+  if (stat(E.filename, &st) == -1)
+    return E.savedsize != -1;
+  return st.st_size != E.savedsize ||
+         st.st_mtim.tv_sec != E.savedmtime.tv_sec ||
+         st.st_mtim.tv_nsec != E.savedmtime.tv_nsec;
+}
+
+/* Load the file of the current buffer again, in the same slot, keeping
+ * the cursor row if the file is still long enough. */
+static void editorReloadBuffer(void) {
+  unsigned int rowoff = E.rowoff, cy = E.cy;
+  char *filename = strdup(E.filename);
+
+  editorFreeBuffer();
+  editorOpen(filename);
+  free(filename);
+  if (rowoff + cy <= E.numrows) {
+    E.rowoff = rowoff;
+    E.cy = cy;
+  }
+  editorInvalidateScreen();
+}
+
+/* Switch to the buffer of 'filename', opening it if needed. A buffer left
+ * loaded by a previous client is reloaded if the file changed since, or
+ * just flagged if it has changes of its own: returns 1 in that case. */
+int editorEditFile(char *filename) {
+  char cwd[PATH_MAX], path[PATH_MAX * 2];
+  int j;
+
+  /* The buffer outlives the directory of the client that named it. */
+  if (server && *filename != '/' && getcwd(cwd, sizeof(cwd))) {
+    snprintf(path, sizeof(path), "%s/%s", cwd, filename);
+    filename = path;
+  }
+  j = editorFindBuffer(filename);
+  if (j == -1) {
+    editorAddBuffer(filename);
+    return 0;
+  }
+  editorSwitchBuffer((unsigned int)j);
+  if (!editorFileIsStale())
+    return 0;
+  if (editorFileWasModified()) {
+    editorSetStatusMessage("WARNING: \"%.40s\" changed on disk, :w "
+                           "overwrites it", E.filename);
+    return 1;
+  }
+  editorReloadBuffer();
+  editorSetStatusMessage("\"%.40s\" changed on disk, reloaded", E.filename);
+  return 0;
+}
+
+/* Drop the current buffer without asking, and show the next one. Closing
+ * the last buffer leaves an empty one, with no file. */
+void editorCloseBuffer(void) {
+  editorFreeBuffer();
+  if (nbufs <= 1) {
+    nbufs = curbuf = 0;
+    return;
+  }
+  memmove(bufs + curbuf, bufs + curbuf + 1,
+          sizeof(*bufs) * (nbufs - curbuf - 1));
+  nbufs--;
+  editorLoadBuffer(curbuf < nbufs ? curbuf : nbufs - 1);
+}
+
+/* Number of buffers differing from their file on disk. */
+static unsigned int editorModifiedBuffers(void) {
+  unsigned int n = 0;
+
+  for (unsigned int j = 0; j < nbufs; j++)
+    n += (unsigned int)editorBufferWasModified(j == curbuf ? &E : bufs + j);
+  return n;
+}
+
+/* Remove the journals of all the buffers. */
+void editorCloseJournals(void) {
+  for (unsigned int j = 0; j < nbufs; j++) {
+    editorSwitchBuffer(j);
+    swapClose();
+  }
+}
+
+/* =============================== Command line ============================= */
+
+/* When the file is modified, requires :q to be entered N times before
+ * actually quitting. */
 #define KILO_QUIT_TIMES 3
-void editorProcessKeypress(int fd) {
-  /* When the file is modified, requires Ctrl-q to be pressed N times
-   * before actually quitting. */
-  static int quit_times = KILO_QUIT_TIMES;
+static int quit_times = KILO_QUIT_TIMES;
+static char *cmdline; /* What was typed after ':', */
+static unsigned int cmdlen, cmdcap; /* its length and its allocation. */
+
+/* Show the command line being typed, or its end if it is too long for the
+ * status message. */
+static void editorShowCmdline(void) {
+  unsigned int max = sizeof(E.statusmsg) - 2;
+  editorSetStatusMessage(":%s", cmdline + (cmdlen > max ? cmdlen - max : 0));
+}
 
-  int c = editorReadKey(fd);
+/* Parse an ex-style line address: '.', '$' or a 1-based line number.
+ * On success the zero-based row is stored in *line and 0 is returned. */
+static int editorParseAddr(char **s, unsigned int *line) {
+  char *end;
+
+  if (**s == '.') {
+    *line = E.rowoff + E.cy;
+    (*s)++;
+  } else if (**s == '$') {
+    *line = E.numrows ? E.numrows - 1 : 0;
+    (*s)++;
+  } else if (isdigit((unsigned char)**s)) {
+    unsigned long n = strtoul(*s, &end, 10);
+    if (n == 0 || n > UINT_MAX)
+      return -1;
+    *line = (unsigned int)(n - 1);
+    *s = end;
+  } else
+    return -1;
+  return 0;
+}
+
+/* Parse the optional range at the start of a command: '%', 'a' or 'a,b'.
+ * Without a range the current line is used. Returns the number of
+ * addresses given, or -1 if the range is invalid. */
+static int editorParseRange(char **s, unsigned int *start, unsigned int *end) {
+  *start = *end = E.rowoff + E.cy;
+  if (**s == '%') {
+    (*s)++;
+    *start = 0;
+    *end = E.numrows ? E.numrows - 1 : 0;
+    return 2;
+  }
+  if (editorParseAddr(s, start) == -1)
+    return **s && strchr(".$0123456789", **s) ? -1 : 0;
+  *end = *start;
+  if (**s != ',')
+    return 1;
+  (*s)++;
+  if (editorParseAddr(s, end) == -1 || *end < *start)
+    return -1;
+  return 2;
+}
+
+/* Quit, unless some file has unsaved changes and 'force' is not set. */
+static void editorQuit(int force) {
+  unsigned int modified = editorModifiedBuffers();
+
+  if (modified && !force && quit_times) {
+    if (modified == 1)
+      editorSetStatusMessage("WARNING!!! %s has unsaved changes. "
+                             "Enter :q %d more times to quit.",
+                             editorFileWasModified() ? "File" : "Another file",
+                             quit_times);
+    else
+      editorSetStatusMessage("WARNING!!! %u files have unsaved changes. "
+                             "Enter :q %d more times to quit.",
+                             modified, quit_times);
+    quit_times--;
+    return;
+  }
+  quit = 1;
+}
+
+/* Close the current buffer, unless it has unsaved changes and 'force' is
+ * not set. Closing the last one quits. */
+static void editorBufferDelete(int force) {
+  if (nbufs <= 1) {
+    editorQuit(force);
+    return;
+  }
+  if (editorFileWasModified() && !force && quit_times) {
+    editorSetStatusMessage("WARNING!!! File has unsaved changes. "
+                           "Enter :bd %d more times to close it.",
+                           quit_times);
+    quit_times--;
+    return;
+  }
+  quit_times = KILO_QUIT_TIMES;
+  editorCloseBuffer();
+  editorSwitchBuffer(curbuf); /* Tell which one is shown now. */
+}
+
+/* Execute the command typed after ':'. */
+void editorCommand(char *cmd) {
+  unsigned int start, end;
+  int naddr = editorParseRange(&cmd, &start, &end);
+
+  if (naddr == -1) {
+    editorSetStatusMessage("Invalid range");
+    return;
+  }
+  while (*cmd == ' ')
+    cmd++;
+  if (naddr && !*cmd) {
+    editorJumpTo(end); /* :<line> */
+    return;
+  }
+  if (!strcmp(cmd, "q") || !strcmp(cmd, "q!")) {
+    editorQuit(cmd[1] == '!');
+    return;
+  }
+  if (!strcmp(cmd, "bd") || !strcmp(cmd, "bd!")) {
+    editorBufferDelete(cmd[2] == '!');
+    return;
+  }
+  quit_times = KILO_QUIT_TIMES;
+  if (!strcmp(cmd, "w"))
+    editorSave();
+  else if (cmd[0] == 'e' && (cmd[1] == ' ' || !cmd[1])) {
+    while (*++cmd == ' ')
+      ;
+    if (*cmd)
+      editorEditFile(cmd);
+    else
+      editorSetStatusMessage("No file name");
+  } else if (!strcmp(cmd, "bn"))
+    editorSwitchBuffer((curbuf + 1) % nbufs);
+  else if (!strcmp(cmd, "bp"))
+    editorSwitchBuffer((curbuf + nbufs - 1) % nbufs);
+  else if (!strcmp(cmd, "wq")) {
+    if (editorSave() == 0)
+      editorQuit(0);
+  } else if (*cmd == 's')
+    editorSubstitute(start, end, cmd + 1);
+  else if (*cmd == '!' && naddr)
+    editorFilter(start, end, cmd + 1);
+  else if (!strcmp(cmd, "diff"))
+    editorDiff();
+  else if (*cmd)
+    editorSetStatusMessage("Not an editor command: %s", cmd);
+}
+
+/* ================================ Registers =============================== */
+
+/* [count]dd and [count]yy store lines in a register, 'a' to 'z' if
+ * prefixed with "<reg>, else the unnamed one, and [count]p or P put them
+ * after or before the cursor line. Registers share the content of the
+ * rows they hold with the buffers, see rowShare(): yanking lines copies
+ * pointers, never the bytes, and a put is a single insert. */
+static struct {
+  erow *rows;
+  unsigned int n;
+} registers[27]; /* 'a' to 'z', then the unnamed one. */
+
+static unsigned int editorRegister(int reg) {
+  return reg >= 'a' && reg <= 'z' ? (unsigned int)(reg - 'a') : 26;
+}
+
+/* Store 'n' rows from row 'at' in register 'reg', 0 for the unnamed one.
+ * Returns the number of rows stored. */
+unsigned int editorYank(int reg, unsigned int at, unsigned long n) {
+  unsigned int r = editorRegister(reg);
+
+  for (unsigned int j = 0; j < registers[r].n; j++)
+    rowFree(registers[r].rows[j].chars);
+  if (at >= E.numrows)
+    n = 0;
+  else if (n > E.numrows - at)
+    n = E.numrows - at;
+  registers[r].n = (unsigned int)n;
+  registers[r].rows = realloc(registers[r].rows, sizeof(erow) * n);
+  for (unsigned int j = 0; j < n; j++) {
+    erow *row = registers[r].rows + j;
+
+    *row = E.row[at + j];
+    row->chars = rowShare(row->chars);
+    row->render = NULL;
+    row->hl = NULL;
+    row->rsize = 0;
+    row->mark = PRINTABLE;
+  }
+  return (unsigned int)n;
+}
+
+/* Put register 'reg' 'count' times after the cursor row, or before it if
+ * 'before' is set. */
+void editorPut(int reg, unsigned long count, int before) {
+  unsigned int r = editorRegister(reg);
+  unsigned int filerow = E.rowoff + E.cy, at, n = registers[r].n;
+
+  if (!n) {
+    editorSetStatusMessage("Nothing in register %c", reg ? reg : '"');
+    return;
+  }
+  if (count > (UINT_MAX - E.numrows) / n) {
+    editorSetStatusMessage("Too many lines");
+    return;
+  }
+  at = before ? filerow : filerow + 1;
+  if (at > E.numrows)
+    at = E.numrows;
+
+  erow *rows = malloc(sizeof(erow) * n * count);
+  for (unsigned long k = 0; k < n * count; k++) {
+    rows[k] = registers[r].rows[k % n];
+    rows[k].chars = rowShare(rows[k].chars);
+  }
+  editorInsertRows(at, rows, (unsigned int)(n * count));
+  free(rows);
+  editorJumpTo(at);
+  editorSetStatusMessage("%lu more lines", n * count);
+}
+
+/* ================================= Macros ================================= */
+
+/* q<reg> starts recording the keys typed in register 'a' to 'z', q stops,
+ * [count]@<reg> replays them, and @@ the last register replayed. Replayed
+ * keys go straight to editorProcessKey(), with the screen refresh off, so
+ * only the result gets drawn. */
+#define MACRO_MAXDEPTH 64 /* Macros replaying macros, at most. */
+
+static struct macro {
+  int *keys;
+  unsigned int len, cap;
+} macros[26];
+static int recording = -1; /* Register being recorded, or -1. */
+static int lastmacro = -1; /* Register of the last @, for @@. */
+
+void editorMacroStart(int reg) {
+  if (reg < 'a' || reg > 'z')
+    return;
+  recording = reg - 'a';
+  macros[recording].len = 0;
+  editorSetStatusMessage("recording @%c", reg);
+}
+
+void editorMacroStop(void) {
+  if (recording == -1)
+    return;
+  macros[recording].len--; /* The 'q' that stopped it. */
+  editorSetStatusMessage("@%c: %u keys", 'a' + recording,
+                         macros[recording].len);
+  recording = -1;
+}
+
+static void editorMacroRecord(int c) {
+  struct macro *m = macros + recording;
+
+  if (m->len == m->cap) {
+    m->cap = m->cap ? m->cap * 2 : 64;
+    m->keys = realloc(m->keys, sizeof(int) * m->cap);
+  }
+  m->keys[m->len++] = c;
+}
+
+/* Replay register 'reg' 'count' times, or until the editor quits. */
+void editorMacroReplay(int reg, unsigned long count) {
+  if (reg == '@' && lastmacro != -1)
+    reg = 'a' + lastmacro;
+  if (reg < 'a' || reg > 'z')
+    return;
+  if (replaying == MACRO_MAXDEPTH) {
+    editorSetStatusMessage("Macros nested too deep");
+    return;
+  }
+  lastmacro = reg - 'a';
+
+  struct macro *m = macros + lastmacro;
+  replaying++;
+  while (count-- && !quit)
+    for (unsigned int j = 0; j < m->len && !quit; j++)
+      editorProcessKey(m->keys[j]);
+  replaying--;
+}
+
+/* Process a key typed by the user, recording it if needed. */
+void editorTypeKey(int c) {
+  if (recording != -1)
+    editorMacroRecord(c);
+  editorProcessKey(c);
+}
+
+/* Process a key, typed or replayed. */
+void editorProcessKey(int c) {
   if (c == ESC) {
     mode = NOMODE;
     editorSetStatusMessage(" ");
   }
   if (mode == NOMODE) {
-    if ((char)c == 'i') {
+    static int prefix;          /* g q @ " d or y, waiting for a key. */
+    static unsigned long count; /* Typed before the command, 0 if none. */
+    static int reg;             /* Register given with ", 0 if none. */
+    unsigned long n = count;
+    int p = prefix;
+
+    if (c >= '0' && c <= '9' && (count || c != '0') && !p) {
+      if (count < 100000000)
+        count = count * 10 + (unsigned long)(c - '0');
+      return;
+    }
+    /* Recording is for the user: replayed keys can't start or stop it. */
+    if (!p && (c == 'g' || c == '@' || c == '"' || c == 'd' || c == 'y' ||
+               (c == 'q' && recording == -1 && !replaying))) {
+      prefix = c;
+      return;
+    }
+    prefix = 0;
+    if (p == '"') {
+      reg = c >= 'a' && c <= 'z' ? c : 0; /* The count is kept: 3"add */
+      return;
+    }
+    int r = reg;
+    count = 0;
+    reg = 0;
+    if (p == 'd' && c == 'd') {
+      unsigned int line = E.rowoff + E.cy;
+      unsigned int deleted = editorYank(r, line, n ? n : 1);
+      editorDelRows(line, deleted);
+      editorJumpTo(line);
+      editorSetStatusMessage("%u fewer lines", deleted);
+    } else if (p == 'y' && c == 'y')
+      editorSetStatusMessage("%u lines yanked",
+                             editorYank(r, E.rowoff + E.cy, n ? n : 1));
+    else if (c == 'p' || c == 'P')
+      editorPut(r, n ? n : 1, c == 'P');
+    else if (p == 'q')
+      editorMacroStart(c);
+    else if (p == '@')
+      editorMacroReplay(c, n ? n : 1);
+    else if (p == 'g' && c == 'g')
+      editorJumpTo(n ? (unsigned int)n - 1 : 0);
+    else if (c == 'q' && !replaying)
+      editorMacroStop();
+    else if (c == 'G')
+      editorJumpTo(n ? (unsigned int)n - 1 : UINT_MAX);
+    else if (c == PAGE_UP || c == PAGE_DOWN)
+      editorPage(c);
+    else if (c == ARROW_UP || c == ARROW_DOWN || c == ARROW_LEFT ||
+             c == ARROW_RIGHT || c == 'h' || c == 'j' || c == 'k' ||
+             c == 'l') {
+      /* hjkl too: scripts and macros can't type the arrow keys. */
+      if (c == 'h')
+        c = ARROW_LEFT;
+      else if (c == 'j')
+        c = ARROW_DOWN;
+      else if (c == 'k')
+        c = ARROW_UP;
+      else if (c == 'l')
+        c = ARROW_RIGHT;
+      for (n = n ? n : 1; n; n--)
+        editorMoveCursor(c);
+    } else if ((char)c == 'i') {
       mode = INSERT;
       editorSetStatusMessage("--INSERT--");
     } else if ((char)c == ':') {
       mode = COMMAND;
+      cmdlen = 0;
+      if (!cmdcap)
+        cmdline = malloc(cmdcap = 80);
+      cmdline[0] = '\0';
       editorSetStatusMessage(":");
     }
   } else if (mode == COMMAND) {
-    if ((char)c == 'w') {
-      editorSave();
-      editorSetStatusMessage("written");
-    } else if ((char)c == 'q') {
-      if (E.dirty && quit_times) {
-        editorSetStatusMessage("WARNING!!! File has unsaved changes. "
-                               "Press q %d more times to quit.",
-                               quit_times);
-        quit_times--;
-        return;
+    if (c == ENTER) {
+      mode = NOMODE;
+      editorSetStatusMessage(" ");
+      editorCommand(cmdline);
+    } else if (c == BACKSPACE || c == DEL_KEY) {
+      if (cmdlen) {
+        cmdline[--cmdlen] = '\0';
+        editorShowCmdline();
+      } else {
+        mode = NOMODE;
+        editorSetStatusMessage(" ");
       }
-      exit(0);
+    } else if (c >= SCHAR_MIN && c <= UCHAR_MAX && (c < 0 || c >= ' ') &&
+               c != BACKSPACE) {
+      /* Bytes above 0x7f, as in UTF-8 text, are negative if char is. */
+      if (cmdlen + 2 > cmdcap)
+        cmdline = realloc(cmdline, cmdcap *= 2);
+      cmdline[cmdlen++] = (char)c;
+      cmdline[cmdlen] = '\0';
+      editorShowCmdline();
     }
   } else {
+    quit_times = KILO_QUIT_TIMES; /* Reset it to the original value. */
     switch (c) {
     case ENTER: /* Enter */
       editorInsertNewline();
@@ -832,15 +3015,7 @@ void editorProcessKeypress(int fd) {
       break;
     case PAGE_UP:
     case PAGE_DOWN:
-      if (c == PAGE_UP && E.cy != 0)
-        E.cy = 0;
-      else if (c == PAGE_DOWN && E.cy != E.screenrows - 1)
-        E.cy = E.screenrows - 1;
-      {
-        unsigned int times = E.screenrows;
-        while (times--)
-          editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-      }
+      editorPage(c);
       break;
     case ARROW_UP:
     case ARROW_DOWN:
@@ -856,10 +3031,16 @@ void editorProcessKeypress(int fd) {
       break;
     }
   }
-  quit_times = KILO_QUIT_TIMES; /* Reset it to the original value. */
 }
 
-int editorFileWasModified(void) { return E.dirty; }
+/* Process events arriving from the standard input, which is, the user
+ * is typing stuff on the terminal. */
+void editorProcessKeypress(int fd) {
+  int c = editorReadKey(fd);
+  if (c == RESIZE || c == HANGUP)
+    return;
+  editorTypeKey(c);
+}
 
 void updateWindowSize(void) {
   if (getWindowSize(STDIN_FILENO, STDOUT_FILENO, &E.screenrows,
@@ -870,13 +3051,26 @@ void updateWindowSize(void) {
   E.screenrows -= 2; /* Get room for status bar. */
 }
 
-void handleSigWinCh(int unused __attribute__((unused))) {
+/* SIGWINCH only raises 'winch': the new size is picked up by the main loop
+ * or editorReadKey(), as the handler can't touch the screen state safely. */
+void handleSigWinCh(int unused __attribute__((unused))) { winch = 1; }
+
+void editorWindowChanged(void) {
+  winch = 0;
   updateWindowSize();
-  if (E.cy > E.screenrows)
-    E.cy = E.screenrows - 1;
-  if (E.cx > E.screencols)
-    E.cx = E.screencols - 1;
-  editorRefreshScreen();
+  editorClampCursor();
+  editorUncacheOutside(E.rowoff, E.screenrows);
+  editorInvalidateScreen();
+}
+
+/* Use a window size reported by a ki client, keeping the cursor row on
+ * screen. */
+void editorResize(unsigned int rows, unsigned int cols) {
+  E.screenrows = rows > 2 ? rows - 2 : 1;
+  E.screencols = cols ? cols : 1;
+  editorClampCursor();
+  editorUncacheOutside(E.rowoff, E.screenrows);
+  editorInvalidateScreen();
 }
 
 void initEditor(void) {
@@ -886,26 +3080,394 @@ void initEditor(void) {
   E.coloff = 0;
   E.numrows = 0;
   E.row = NULL;
-  E.dirty = 0;
+  E.hash = E.savedhash = 0;
+  E.savedrow = NULL;
+  E.savedrows = 0;
   E.filename = NULL;
-  updateWindowSize();
-  signal(SIGWINCH, handleSigWinCh);
+  E.swapfd = -1;
+  E.swapname = NULL;
+}
+
+/* Drop the loaded file, and its journal. */
+void editorFreeBuffer(void) {
+  for (unsigned int j = 0; j < E.numrows; j++)
+    editorFreeRow(E.row + j);
+  free(E.row);
+  swapClose();
+  free(E.swapname);
+  free(E.filename);
+  free(E.savedrow);
+  initEditor();
+}
+
+/* ============================== Client/server ============================= */
+
+/* 'ki --server' keeps files loaded in a long running process. 'ki <file>'
+ * first tries to connect to it over a Unix domain socket: if it succeeds
+ * it just forwards the keys it reads and the frames it gets back between
+ * the terminal and the server, so reopening a file costs no parsing and
+ * no window size query. Clients are served one at a time: the server
+ * answers "ok" to the hello of the one it serves, and "busy" to the ones
+ * connecting meanwhile. The files stay loaded when a client detaches,
+ * except the ones it quit with unsaved changes. Both ends check that the
+ * other runs as the same user. */
+
+/* Fill 'sa' with the socket path: $KI_SOCKET, else $XDG_RUNTIME_DIR/ki.sock
+ * in the private directory of the user, else /tmp/ki-<uid>.sock. */
+static int editorSocketPath(struct sockaddr_un *sa) {
+  char *env = getenv("KI_SOCKET"), *dir = getenv("XDG_RUNTIME_DIR");
+  int len;
+
+  memset(sa, 0, sizeof(*sa));
+  sa->sun_family = AF_UNIX;
+  if (env)
+    len = snprintf(sa->sun_path, sizeof(sa->sun_path), "%s", env);
+  else if (dir && *dir)
+    len = snprintf(sa->sun_path, sizeof(sa->sun_path), "%s/ki.sock", dir);
+  else
+    len = snprintf(sa->sun_path, sizeof(sa->sun_path), "/tmp/ki-%u.sock",
+                   (unsigned int)getuid());
+  return len < 0 || (size_t)len >= sizeof(sa->sun_path) ? -1 : 0;
+}
+
+/* Does the process at the other end of 'fd' run as our user? */
+static int editorPeerIsUs(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+         cred.uid == getuid();
+}
+
+static volatile sig_atomic_t client_winch;
+static void handleClientWinCh(int unused __attribute__((unused))) {
+  client_winch = 1;
+}
+
+/* Attach the terminal to a running server to edit the 'nfiles' files in
+ * 'files'. Returns -1 if there is no server, so that the caller runs the
+ * editor itself, 1 if the server turned us away and 0 once detached. */
+int editorClient(char **files, int nfiles) {
+  struct sockaddr_un sa;
+  struct abuf hello = ABUF_INIT;
+  char buf[PATH_MAX + 64], cwd[PATH_MAX], *path;
+  unsigned int rows, cols, i = 0;
+  struct winsize ws;
+  int fd, len = 0;
+
+  if (editorSocketPath(&sa) == -1 ||
+      (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    return -1;
+  /* The terminal stays as it is until the server says it serves us. */
+  if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+      ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+    close(fd);
+    return -1;
+  }
+  if (!editorPeerIsUs(fd)) {
+    fprintf(stderr, "ki: %s belongs to another user, not using it\n",
+            sa.sun_path);
+    close(fd);
+    return -1;
+  }
+  rows = ws.ws_row;
+  cols = ws.ws_col;
+
+  /* Hello: "<rows> <cols>\n", "<working directory>\n", then
+   * "<absolute path>\n" for every file, then an empty line. */
+  snprintf(buf, sizeof(buf), "%u %u\n%s\n", rows, cols,
+           getcwd(cwd, sizeof(cwd)) ? cwd : "/");
+  abAppend(&hello, buf, (unsigned int)strlen(buf));
+  for (int j = 0; j < nfiles && len >= 0 && (size_t)len < sizeof(buf); j++) {
+    path = realpath(files[j], NULL);
+    if (path)
+      len = snprintf(buf, sizeof(buf), "%s\n", path);
+    else if (*files[j] != '/' && getcwd(cwd, sizeof(cwd)))
+      len = snprintf(buf, sizeof(buf), "%s/%s\n", cwd, files[j]);
+    else
+      len = snprintf(buf, sizeof(buf), "%s\n", files[j]);
+    free(path);
+    if (len >= 0 && (size_t)len < sizeof(buf))
+      abAppend(&hello, buf, (unsigned int)len);
+  }
+  abAppend(&hello, "\n", 1);
+  if (len < 0 || (size_t)len >= sizeof(buf)) {
+    abFree(&hello);
+    close(fd);
+    return -1;
+  }
+  /* A busy server may hang up before reading the hello: the answer it
+   * left says why, so a failed write is not an error yet. */
+  signal(SIGPIPE, SIG_IGN);
+  writeAll(fd, hello.b, hello.len);
+  abFree(&hello);
+
+  /* The answer: "ok\n", or "busy\n" if another client is attached. */
+  while (i < sizeof(buf) - 1 && editorReadTimeout(fd, buf + i, 5000) &&
+         buf[i] != '\n')
+    i++;
+  buf[i] = '\0';
+  if (strcmp(buf, "ok") || enableRawMode(STDIN_FILENO) == -1) {
+    fprintf(stderr, "ki: the server at %s %s\n", sa.sun_path,
+            !strcmp(buf, "busy") ? "is busy with another client"
+                                 : "did not answer");
+    close(fd);
+    return 1;
+  }
+
+  signal(SIGWINCH, handleClientWinCh);
+  struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+  while (1) {
+    ssize_t n;
+
+    if (client_winch) {
+      client_winch = 0;
+      if (getWindowSize(STDIN_FILENO, STDOUT_FILENO, &rows, &cols) == 0) {
+        len = snprintf(buf, sizeof(buf), "\x1b[8;%u;%ut", rows, cols);
+        if (writeAll(fd, buf, (size_t)len) == -1)
+          break;
+      }
+    }
+    if (poll(pfd, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (pfd[0].revents & POLLIN) {
+      n = read(STDIN_FILENO, buf, sizeof(buf));
+      if (n > 0 && writeAll(fd, buf, (size_t)n) == -1)
+        break;
+    }
+    if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+      n = read(fd, buf, sizeof(buf));
+      if (n <= 0 || writeAll(STDOUT_FILENO, buf, (size_t)n) == -1)
+        break;
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+/* Serve a client until it quits or goes away. */
+static void editorServe(int client, int devnull) {
+  struct abuf hello = ABUF_INIT;
+  unsigned int rows, cols, nfiles = 0, stale = 0;
+  char c, *p, *dir, *files;
+  int nodir; /* errno of a failed chdir() to the client directory. */
+
+  /* Read the whole hello before opening anything: a file may have a
+   * journal to recover, and the answer is read from the client too. */
+  while (editorReadTimeout(client, &c, 1000)) {
+    abAppend(&hello, &c, 1);
+    if (c == '\n' && hello.len >= 2 && hello.b[hello.len - 2] == '\n')
+      break;
+  }
+  abAppend(&hello, "", 1);
+  for (p = hello.b; (p = strchr(p, '\n')) != NULL; nfiles++)
+    *p++ = '\0';
+  if (hello.len < 3 || hello.b[hello.len - 3] || hello.b[hello.len - 2] ||
+      nfiles < 4 || sscanf(hello.b, "%u %u", &rows, &cols) != 2) {
+    abFree(&hello);
+    close(client);
+    return;
+  }
+  nfiles -= 3; /* The size and directory lines, and the empty line. */
+  dir = hello.b + strlen(hello.b) + 1;
+  files = dir + strlen(dir) + 1;
+  if (writeAll(client, "ok\n", 3) == -1) {
+    abFree(&hello);
+    close(client);
+    return;
+  }
+
+  dup2(client, STDIN_FILENO);
+  dup2(client, STDOUT_FILENO);
+  close(client);
+  quit = 0;
+  quit_times = KILO_QUIT_TIMES;
+  mode = NOMODE;
+  editorSetStatusMessage(" ");
+  editorResize(rows, cols);
+  /* Relative names typed with :e, and :!cmd, are the client's. */
+  nodir = chdir(dir) == -1 ? errno : 0;
+  /* Open them all, then show the first one. A single file keeps the
+   * message of its opening, as about its journal. */
+  p = files;
+  for (unsigned int j = 0; j < nfiles; j++, p += strlen(p) + 1)
+    stale += (unsigned int)editorEditFile(p);
+  if (nfiles > 1 && !editorEditFile(files) && stale)
+    editorSetStatusMessage("WARNING: %u files with unsaved changes "
+                           "changed on disk", stale);
+  if (nodir)
+    editorSetStatusMessage("Can't change to %.40s! %s", dir,
+                           strerror(nodir));
+  abFree(&hello);
+
+  while (!quit) {
+    editorRefreshScreen();
+    swapFlush();
+    editorProcessKeypress(STDIN_FILENO);
+  }
+  swapFlush();
+  /* Quitting with unsaved changes means dropping them. */
+  for (unsigned int j = nbufs; quit == 1 && j--;) {
+    editorSwitchBuffer(j);
+    if (editorFileWasModified())
+      editorCloseBuffer();
+  }
+  dup2(devnull, STDIN_FILENO);
+  dup2(devnull, STDOUT_FILENO);
+}
+
+/* Wait for the next byte of the client on 'fd', telling the clients that
+ * connect meanwhile that the server is busy. */
+static void editorServerWait(int fd) {
+  struct pollfd pfd[2] = {{fd, POLLIN, 0}, {listenfd, POLLIN, 0}};
+  int client;
+
+  while (1) {
+    if (poll(pfd, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    if (pfd[0].revents)
+      return;
+    if ((pfd[1].revents & POLLIN) &&
+        (client = accept(listenfd, NULL, NULL)) != -1) {
+      if (editorPeerIsUs(client))
+        writeAll(client, "busy\n", 5);
+      close(client);
+    }
+  }
+}
+
+int editorServer(void) {
+  struct sockaddr_un sa;
+  int fd, client, ret, devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+  mode_t mask;
+
+  /* Filter commands inherit neither. */
+  if (devnull == -1 || editorSocketPath(&sa) == -1 ||
+      (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+    perror("Creating the server socket");
+    return 1;
+  }
+  unlink(sa.sun_path);
+  mask = umask(077); /* Only our user may connect to the socket. */
+  ret = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+  umask(mask);
+  if (ret == -1 || listen(fd, 16) == -1) {
+    perror(sa.sun_path);
+    return 1;
+  }
+  server = 1;
+  listenfd = fd;
+  signal(SIGPIPE, SIG_IGN);
+  dup2(devnull, STDIN_FILENO);
+  dup2(devnull, STDOUT_FILENO);
+  initEditor();
+  fprintf(stderr, "ki: serving on %s\n", sa.sun_path);
+  while ((client = accept(fd, NULL, NULL)) != -1 || errno == EINTR) {
+    if (client != -1 && editorPeerIsUs(client))
+      editorServe(client, devnull);
+    else if (client != -1)
+      close(client);
+  }
+  perror("accept");
+  return 1;
 }
+
+/* 'ki -s script <file>...' types the keys in 'script' ("-" for the
+ * standard input) without a terminal: nothing is drawn, there is no
+ * journal, and a newline is Enter. The script is read whole first, so it
+ * runs at the speed of a macro. Returns 0 if the script quit. */
+int editorScript(char *script, char **files, int nfiles) {
+  int fd = strcmp(script, "-") ? open(script, O_RDONLY) : STDIN_FILENO;
+  struct abuf keys = ABUF_INIT;
+  char buf[65536];
+  ssize_t n;
+
+  if (fd == -1) {
+    perror(script);
+    return 1;
+  }
+  while ((n = read(fd, buf, sizeof(buf))) > 0 || (n == -1 && errno == EINTR))
+    if (n > 0)
+      abAppend(&keys, buf, (unsigned int)n);
+  if (n == -1) {
+    perror(script);
+    return 1;
+  }
+
+  headless = 1;
+  initEditor();
+  editorResize(24, 80);
+  for (int j = 0; j < nfiles; j++)
+    editorAddBuffer(files[j]);
+  editorSwitchBuffer(0);
+  for (unsigned int j = 0; j < keys.len && !quit; j++)
+    editorTypeKey(keys.b[j] == '\n' ? ENTER : keys.b[j]);
+  abFree(&keys);
+  if (quit != 1) {
+    fprintf(stderr, "ki: the script did not quit, changes are lost\n");
+    return 1;
+  }
+  return 0;
+}
+
 int printHelp(void) {
-  printf("Usage: ki <file>\n"
-         "Esc then : then q to quit\n"
-         "Esc then : then w to save\n"
-         "i to insert\n");
+  printf("Usage: ki <file>...\n"
+         "       ki -s <script> <file>...\n"
+         "       ki --server\n"
+         "Esc then :q Enter to quit\n"
+         "Esc then :w Enter to save\n"
+         "Esc then :%%s/old/new/g Enter to substitute\n"
+         "Esc then :<line> Enter, gg or G to jump to a line\n"
+         "Esc then :%%!cmd Enter to filter the lines through cmd\n"
+         "Esc then :diff Enter to mark the lines changed since saved\n"
+         "Esc then :e <file> Enter to edit another file\n"
+         "Esc then :bn, :bp or :bd Enter for the next, previous or to close\n"
+         "h, j, k, l or the arrows to move, [count] before to repeat\n"
+         "q<a-z> to record a macro, q to stop, [count]@<a-z> to replay it\n"
+         "[\"<a-z>][count]dd, yy or p to delete, yank or put lines\n"
+         "i to insert\n"
+         "KI_SWAPSYNC=<secs> sets how often the swap file is synced\n"
+         "KI_SOCKET=<path> sets the server socket\n"
+         "KI_INTERN=1 makes identical lines share their memory\n");
   return -1;
 }
 int main(int argc, char **argv) {
-  if (argc != 2)
+  int ret;
+
+  if (argc == 2 && !strcmp(argv[1], "--server"))
+    return editorServer();
+  if (argc >= 4 && !strcmp(argv[1], "-s"))
+    return editorScript(argv[2], argv + 3, argc - 3);
+  if (argc < 2)
     return printHelp();
+  if ((ret = editorClient(argv + 1, argc - 1)) != -1)
+    return ret;
   initEditor();
-  editorOpen(argv[1]);
+  updateWindowSize();
+  /* No SA_RESTART: a resize interrupts the read of the next key. */
+  struct sigaction sa = {0};
+  sa.sa_handler = handleSigWinCh;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGWINCH, &sa, NULL);
   enableRawMode(STDIN_FILENO);
-  while (1) {
+  for (int j = 1; j < argc; j++)
+    editorAddBuffer(argv[j]);
+  if (nbufs > 1)
+    editorSwitchBuffer(0); /* Else keep what opening the file said. */
+  while (!quit) {
+    if (winch)
+      editorWindowChanged();
     editorRefreshScreen();
+    swapFlush();
     editorProcessKeypress(STDIN_FILENO);
   }
+  if (quit == 1)
+    editorCloseJournals();
+  return 0;
 }
@@ -0,0 +1,35 @@
+#!/bin/sh
+# The ':' command line takes any byte, and commands of any length.
+# Usage: tests/cmdline.sh ./ki
+KI=${1:-./ki}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+check() {
+  if cmp -s "$dir/expected" "$dir/file"; then
+    echo "ok - $1"
+  else
+    echo "not ok - $1"
+    fail=1
+  fi
+}
+
+# UTF-8 in a substitution: bytes above 0x7f.
+printf 'a1b\nc1d\n' > "$dir/file"
+printf 'a\303\274b\nc\303\274d\n' > "$dir/expected"
+printf ':%%s/1/\303\274/\n:wq\n' > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check ":s replaces with a UTF-8 character"
+
+# A filter command longer than the status line.
+seq 20 | awk '{ print "k" ($1 % 3) " v" $1 }' > "$dir/file"
+printf 'total k0: 63\ntotal k1: 70\ntotal k2: 77\n' > "$dir/expected"
+cat > "$dir/keys" <<'KEYS'
+:%!awk '{ s[$1] += substr($2, 2) } END { for (k in s) print k, s[k] }' | sort | awk '{ print "total " $1 ": " $2 }'
+:wq
+KEYS
+"$KI" -s "$dir/keys" "$dir/file"
+check "a :%!cmd of over 100 characters runs whole"
+
+exit $fail
@@ -0,0 +1,62 @@
+#!/bin/sh
+# :%!cmd on more rows than fit in one writev(), with empty rows among them,
+# and ranges or commands that must leave the buffer alone.
+# Usage: tests/filter.sh ./ki
+KI=${1:-./ki}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+check() {
+  if cmp -s "$dir/expected" "$dir/file"; then
+    echo "ok - $1"
+  else
+    echo "not ok - $1"
+    fail=1
+  fi
+}
+
+# 1201 rows, the first one and every seventh one empty.
+awk 'BEGIN { for (i = 0; i < 1201; i++) print (i % 7 ? "row " i : "") }' \
+  > "$dir/file"
+cp "$dir/file" "$dir/expected"
+printf ':%%!cat\n:wq\n' > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check "cat keeps 1201 rows with empty ones"
+
+# Only empty rows: one iovec per row.
+awk 'BEGIN { for (i = 0; i < 3000; i++) print "" }' > "$dir/file"
+cp "$dir/file" "$dir/expected"
+"$KI" -s "$dir/keys" "$dir/file"
+check "cat keeps 3000 empty rows"
+
+# A command that stops reading early still replaces the range.
+awk 'BEGIN { for (i = 0; i < 200000; i++) print (i % 3 ? "line " i : "") }' \
+  > "$dir/file"
+head -n 5 "$dir/file" > "$dir/expected"
+printf ':%%!head -n 5\n:wq\n' > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check "head -n 5 keeps its 5 rows"
+
+# Ranges past the end of an empty, or of a new, file.
+: > "$dir/file"
+: > "$dir/expected"
+printf ':2!cat\n:1,5!cat\n:wq\n' > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check "an empty file rejects :2!cat and :1,5!cat"
+
+rm -f "$dir/file"
+echo hi > "$dir/expected"
+printf ':2!echo no\n:1!echo hi\n:wq\n' > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check "a new file rejects :2!, takes :1!"
+
+# A range past the end of the file, and commands that fail.
+seq 10 > "$dir/file"
+cp "$dir/file" "$dir/expected"
+printf ':20,30!echo hi\n:%%!sortt\n:%%!echo out; exit 3\n:wq\n' \
+  > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file" 2> /dev/null
+check "a bad range or a failing command leaves the rows alone"
+
+exit $fail
@@ -0,0 +1,55 @@
+#!/bin/sh
+# [count]dd, yy, p and P with the unnamed and named registers, and edits
+# to put rows that must not reach the register or the rows they came from.
+# Usage: tests/registers.sh ./ki
+KI=${1:-./ki}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+fail=0
+esc=$(printf '\033')
+
+check() {
+  if cmp -s "$dir/expected" "$dir/file"; then
+    echo "ok - $1"
+  else
+    echo "not ok - $1"
+    fail=1
+  fi
+}
+
+# dd then p moves a row down.
+printf '1\n2\n3\n' > "$dir/file"
+printf '2\n1\n3\n' > "$dir/expected"
+printf 'ddp:wq\n' > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check "ddp swaps two rows"
+
+# A count on dd, clamped to the end of the file, and P.
+seq 5 > "$dir/file"
+printf '4\n5\n1\n2\n3\n' > "$dir/expected"
+printf '3j9ddggP:wq\n' > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check "9dd on the last two rows, then P on the first"
+
+# Named registers keep their rows apart from the unnamed one.
+printf 'a\nb\nc\n' > "$dir/file"
+printf 'a\nb\nc\nb\na\nb\n' > "$dir/expected"
+printf '"ayyjyyG2p"ap:wq\n' > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check "\"ayy, yy, 2p and \"ap"
+
+# Editing a row put twice, or the row it came from, changes only that row.
+printf 'x\n' > "$dir/file"
+printf '1x\n2x\nx\nx\n' > "$dir/expected"
+printf 'yy2pi2%sggi1%sGp:wq\n' "$esc" "$esc" > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check "a put row shares nothing that edits can see"
+
+# Putting an empty register does nothing.
+printf 'a\n' > "$dir/file"
+cp "$dir/file" "$dir/expected"
+printf '"zp:wq\n' > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check "\"zp with nothing in z"
+
+exit $fail
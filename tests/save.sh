@@ -0,0 +1,61 @@
+#!/bin/sh
+# :w rewrites only the rows after the unchanged prefix, nothing when the
+# buffer is unchanged, and the whole file when it changed on disk.
+# Usage: tests/save.sh ./ki
+KI=${1:-./ki}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+fail=0
+esc=$(printf '\033')
+bs=$(printf '\177')
+
+check() {
+  if cmp -s "$dir/expected" "$dir/file"; then
+    echo "ok - $1"
+  else
+    echo "not ok - $1"
+    fail=1
+  fi
+}
+
+# An edit in the middle.
+seq 10 > "$dir/file"
+seq 10 | sed 's/^5$/x5/' > "$dir/expected"
+printf '4jix%s:wq\n' "$esc" > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check "an edit in the middle"
+
+# Rows appended to a file without a final newline.
+printf 'a\nb' > "$dir/file"
+printf 'a\nb\nc\nd\n' > "$dir/expected"
+printf 'jli\nc\nd%s:wq\n' "$esc" > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check "rows appended after a last row without a newline"
+
+# A :w with nothing changed leaves the file, and its mtime, alone.
+printf 'a\nb' > "$dir/file"
+cp "$dir/file" "$dir/expected"
+touch -d '2001-01-01' "$dir/file"
+touch -r "$dir/file" "$dir/ref"
+printf 'ix%s%s:wq\n' "$bs" "$esc" > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check "an undone edit writes nothing"
+if [ "$dir/file" -nt "$dir/ref" ]; then
+  echo "not ok - an undone edit keeps the mtime"
+  fail=1
+else
+  echo "ok - an undone edit keeps the mtime"
+fi
+
+# The file changes on disk, with the same size, before :w: the buffer's
+# prefix can't be trusted to be there any more.
+seq 10 > "$dir/file"
+seq 10 | sed 's/^10$/x10/' > "$dir/expected"
+cat > "$dir/keys" <<KEYS
+:10!cat; seq 10 | tr 0-9 a-j > "$dir/file"; touch -d 2001-01-01 "$dir/file"
+10Gix$esc:wq
+KEYS
+"$KI" -s "$dir/keys" "$dir/file"
+check "a file changed on disk is written whole"
+
+exit $fail
@@ -0,0 +1,67 @@
+#!/bin/sh
+# :s on a range or the whole file, the first match of a row or all of them,
+# with escaped delimiters, and on enough rows to run on several threads.
+# Usage: tests/substitute.sh ./ki
+KI=${1:-./ki}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+check() {
+  if cmp -s "$dir/expected" "$dir/file"; then
+    echo "ok - $1"
+  else
+    echo "not ok - $1"
+    fail=1
+  fi
+}
+
+# The first match of a row, or all of them with g.
+printf 'aa aa\naa\n' > "$dir/file"
+printf 'b aa\nb\n' > "$dir/expected"
+printf ':%%s/aa/b/\n:wq\n' > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check ":%s replaces the first match of each row"
+
+printf 'aa aa\naa\n' > "$dir/file"
+printf 'bbb bbb\nbbb\n' > "$dir/expected"
+printf ':%%s/aa/bbb/g\n:wq\n' > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check ":%s///g replaces every match"
+
+# Only the rows of the range, which is clamped to the file.
+seq 10 | awk '{ print "r" $1 }' > "$dir/file"
+seq 10 | awk '{ print (NR < 3 ? "r" : "row ") $1 }' > "$dir/expected"
+printf ':3,20s/r/row /\n:wq\n' > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check ":3,20s changes rows 3 to the end only"
+
+# Escaped and other delimiters, and an empty replacement.
+printf 'a/b\\c d\n' > "$dir/file"
+printf 'a|c\n' > "$dir/expected"
+printf ':s/\\//|/\n:s#b\\\\##\n:s, d,,\n:wq\n' > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check ":s with escaped and other delimiters"
+
+# No match leaves the file alone.
+printf 'abc\n' > "$dir/file"
+cp "$dir/file" "$dir/expected"
+printf ':%%s/x/y/g\n:wq\n' > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check ":s without a match changes nothing"
+
+# Enough rows for a thread per core, each row changed, grown or shrunk.
+awk 'BEGIN { for (i = 0; i < 300000; i++) print (i % 2 ? "ab" i "ab" : i) }' \
+  > "$dir/file"
+awk 'BEGIN { for (i = 0; i < 300000; i++) print (i % 2 ? "xyz" i "xyz" : i) }' \
+  > "$dir/expected"
+printf ':%%s/ab/xyz/g\n:wq\n' > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check ":%s on 300000 rows"
+
+seq 0 299999 > "$dir/expected"
+printf ':%%s/xyz//g\n:wq\n' > "$dir/keys"
+"$KI" -s "$dir/keys" "$dir/file"
+check ":%s shrinking 150000 rows"
+
+exit $fail
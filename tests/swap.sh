@@ -0,0 +1,64 @@
+#!/bin/sh
+# A session killed with unsaved changes leaves its journal behind: the next
+# one replays it on y, and drops it on n. Needs script(1) for a terminal.
+# Usage: tests/swap.sh ./ki
+KI=${1:-./ki}
+if ! script -qec true /dev/null > /dev/null 2>&1; then
+  echo "ok # skip no script(1) to run ki on a terminal"
+  exit 0
+fi
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+check() {
+  if cmp -s "$dir/expected" "$dir/file"; then
+    echo "ok - $1"
+  else
+    echo "not ok - $1"
+    fail=1
+  fi
+}
+
+# Type $1 in ki on 'file', once it is up, then kill it.
+crash() {
+  (sleep 1; printf '%s' "$1"; sleep 2) |
+    script -qec "stty rows 24 cols 80; echo \$\$ > '$dir/pid'
+      exec '$KI' '$dir/file'" /dev/null > /dev/null &
+  sleep 2
+  kill -9 "$(cat "$dir/pid")"
+  wait
+}
+
+# Answer $1 to the recovery prompt, then type $2.
+recover() {
+  (sleep 1; printf '%s' "$1"; sleep 1; printf '%s' "$2"; sleep 1) |
+    script -qec "stty rows 24 cols 80; exec '$KI' '$dir/file'" /dev/null \
+      > /dev/null
+}
+
+printf 'a\nb\n' > "$dir/file"
+crash "$(printf 'ix\ry\033')"
+if [ -s "$dir/.file.ki-swp" ]; then
+  echo "ok - a killed session leaves its journal"
+else
+  echo "not ok - a killed session leaves its journal"
+  fail=1
+fi
+printf 'x\nya\nb\n' > "$dir/expected"
+recover y "$(printf ':wq\r')"
+check "y replays the journal"
+if [ -e "$dir/.file.ki-swp" ]; then
+  echo "not ok - the journal goes on quit"
+  fail=1
+else
+  echo "ok - the journal goes on quit"
+fi
+
+printf 'a\nb\n' > "$dir/file"
+cp "$dir/file" "$dir/expected"
+crash "$(printf 'ix\033')"
+recover n "$(printf ':wq\r')"
+check "n drops the journal"
+
+exit $fail